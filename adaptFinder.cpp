@@ -12,6 +12,32 @@
 #include <stdexcept>
 #include <unordered_map>
 #include <set>
+#include <map>
+#include <numeric>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <dirent.h>
+#include <glob.h>
+#include <exception>
+#if SEQAN_HAS_ZLIB
+#include <zlib.h>
+#endif
+#if ADAPTFINDER_HAS_ZSTD
+#include <zstd.h>
+#endif
 
 using namespace seqan;
 
@@ -24,6 +50,61 @@ const std::string DNA = "ACGT";
 // Max number of errors, need to be fixed at compile time
 const uint8_t MAXERR = 2; 
 
+// Input name standing for the standard input
+const std::string STDIN_NAME = "-";
+
+// Size of the input buffer used when streaming reads
+const size_t READ_BUFFER_SIZE = 1 << 22;
+
+// Number of decoded buffers waiting for the parser
+const size_t DECODED_QUEUE_SIZE = 4;
+
+// Number of record batches waiting between pipeline stages, and their size
+const size_t PIPELINE_QUEUE_SIZE = 4;
+const size_t PIPELINE_BATCH_SIZE = 1024;
+
+// Number of BGZF blocks inflated per thread and per batch
+const size_t BGZF_BATCH_PER_THREAD = 16;
+
+// Number of Zstandard frames decompressed per thread and per batch
+const size_t ZSTD_BATCH_PER_THREAD = 4;
+
+// Zstandard magic numbers: frames, seek table frame and seek table footer
+const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+const uint32_t ZSTD_SEEK_TABLE_MAGIC = 0x184D2A5E;
+const uint32_t ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+
+// Position of a record that could not be sampled
+const uint64_t NO_RECORD = UINT64_MAX;
+
+// Largest Zstandard frame decompressed at once, larger frames are streamed
+const uint64_t ZSTD_MAX_FRAME_SIZE = 1 << 26;
+
+// FNV-1a hash parameters, used for input fingerprints
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+// Blocks of the input read to compute its fingerprint
+const uint64_t FINGERPRINT_NB_BLOCKS = 16;
+const size_t FINGERPRINT_BLOCK_SIZE = 1 << 16;
+
+// Offset of the Phred quality characters (Sanger / Illumina 1.8+)
+const uint8_t PHRED_OFFSET = 33;
+
+// Largest k counted in a flat array of 4^k counters (256 MB at k = 13),
+// and largest k for which each thread gets its own array
+const uint8_t DENSE_MAX_K = 13;
+const uint8_t DENSE_LOCAL_MAX_K = 10;
+
+// Blocked Bloom filter of the forbidden k-mers: 512 bit blocks (a cache
+// line), bits per k-mer and number of bits set per k-mer
+const uint64_t BLOOM_BLOCK_WORDS = 8;
+const uint64_t BLOOM_BITS_PER_KMER = 12;
+const uint8_t BLOOM_NB_HASH = 7;
+
+// Size of the slices of a reference scanned in parallel for forbidden k-mers
+const uint64_t REFERENCE_SLICE_SIZE = 1 << 20;
+
 // Frequency threshold warning
 const float FREQ_THRESHOLD_WARNING = 0.1;
 
@@ -31,12 +112,170 @@ const float FREQ_THRESHOLD_WARNING = 0.1;
 typedef FastFMIndexConfig<void, uint32_t, 2, 1> TFastConfig;
 using index_t = Index<StringSet<DnaString>, BidirectionalIndex<FMIndex<void,TFastConfig> > >;
 
-// counter type, using unordered map.
-using counter = std::unordered_map<uint64_t,uint64_t>;
+/**
+    K-mer counter: open addressing hash table with Robin Hood probing,
+    all entries in a single array, with 32 bit counts. Compared to an
+    unordered_map, it makes no allocation per k-mer and probes a few
+    neighbouring slots instead of following node pointers.
+    Entries are named as in std::pair, so the table iterates like a map.
+*/
+class kmer_counter_t{
+public:
+    struct entry_t{
+        uint64_t first = 0;     // the k-mer
+        uint32_t second = 0;    // its count
+        uint32_t distance = 0;  // probe distance + 1, 0 for an empty slot
+    };
+
+    class const_iterator{
+    public:
+        const_iterator(entry_t const * slot, entry_t const * end): slot(slot), end(end){ skipEmpty(); }
+        entry_t const & operator*() const{ return(*slot); }
+        entry_t const * operator->() const{ return(slot); }
+        const_iterator & operator++(){ slot++; skipEmpty(); return(*this); }
+        bool operator!=(const_iterator const & other) const{ return(slot != other.slot); }
+        bool operator==(const_iterator const & other) const{ return(slot == other.slot); }
+    private:
+        void skipEmpty(){ while(slot != end and slot->distance == 0) slot++; }
+        entry_t const * slot;
+        entry_t const * end;
+    };
+
+    uint64_t size() const{ return(nb_entries); }
+    const_iterator begin() const{ return(const_iterator(slots.data(), slots.data() + slots.size())); }
+    const_iterator end() const{ return(const_iterator(slots.data() + slots.size(), slots.data() + slots.size())); }
+
+    /**
+        Make room for a number of k-mers, so the table is not rehashed while filling.
+        @param expected number of distinct k-mers
+    */
+    void reserve(uint64_t nb_kmers){
+        uint64_t capacity = MIN_CAPACITY;
+        while(capacity * MAX_LOAD_NUM < nb_kmers * MAX_LOAD_DEN)
+            capacity <<= 1;
+        if(capacity > slots.size())
+            rehash(capacity);
+    }
+
+    /**
+        Remove all the k-mers, the capacity is kept.
+    */
+    void clear(){
+        std::fill(slots.begin(), slots.end(), entry_t());
+        nb_entries = 0;
+    }
+
+    /**
+        Count of a k-mer, inserted with a zero count if missing.
+        @param the k-mer
+        @return reference to its count, valid until the next insertion
+    */
+    uint32_t & operator[](uint64_t kmer){
+        if((nb_entries + 1) * MAX_LOAD_DEN > slots.size() * MAX_LOAD_NUM)
+            rehash(std::max(uint64_t(slots.size() * 2), uint64_t(MIN_CAPACITY)));
+        uint64_t pos = home(kmer);
+        uint32_t distance = 1;
+        // entries are ordered by probe distance, the k-mer cannot be past a closer one
+        while(slots[pos].distance >= distance){
+            if(slots[pos].first == kmer)
+                return(slots[pos].second);
+            pos = (pos + 1) & mask;
+            distance++;
+        }
+        // the new k-mer takes this slot, poorer entries are shifted forward
+        uint64_t inserted = pos;
+        entry_t carried;
+        carried.first = kmer;
+        carried.distance = distance;
+        while(slots[pos].distance != 0){
+            if(slots[pos].distance < carried.distance)
+                std::swap(carried, slots[pos]);
+            pos = (pos + 1) & mask;
+            carried.distance++;
+        }
+        slots[pos] = carried;
+        nb_entries++;
+        return(slots[inserted].second);
+    }
+
+    /**
+        Remove a k-mer, following entries are shifted back (no tombstone).
+        @param the k-mer
+    */
+    void erase(uint64_t kmer){
+        if(slots.empty())
+            return;
+        uint64_t pos = home(kmer);
+        uint32_t distance = 1;
+        while(slots[pos].distance >= distance and slots[pos].first != kmer){
+            pos = (pos + 1) & mask;
+            distance++;
+        }
+        if(slots[pos].distance < distance)
+            return;
+        uint64_t next = (pos + 1) & mask;
+        while(slots[next].distance > 1){
+            slots[pos] = slots[next];
+            slots[pos].distance--;
+            pos = next;
+            next = (next + 1) & mask;
+        }
+        slots[pos] = entry_t();
+        nb_entries--;
+    }
+
+private:
+    static const uint64_t MIN_CAPACITY = 1024;
+    // maximum load factor, 7/8
+    static const uint64_t MAX_LOAD_NUM = 7;
+    static const uint64_t MAX_LOAD_DEN = 8;
+
+    // Fibonacci hashing: the top bits of the product mix all the k-mer bits
+    inline uint64_t home(uint64_t kmer) const{
+        return((kmer * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+
+    void rehash(uint64_t capacity){
+        std::vector<entry_t> old_slots(capacity);
+        old_slots.swap(slots);
+        mask = capacity - 1;
+        shift = 64;
+        while(capacity > 1){
+            capacity >>= 1;
+            shift--;
+        }
+        nb_entries = 0;
+        for(entry_t const & entry: old_slots){
+            if(entry.distance != 0)
+                (*this)[entry.first] = entry.second;
+        }
+    }
+
+    std::vector<entry_t> slots;
+    uint64_t nb_entries = 0;
+    uint64_t mask = 0;
+    uint32_t shift = 64;
+};
+
+// counter type, using an open addressing table.
+using counter = kmer_counter_t;
+
+/**
+    Upper bound of the number of distinct k-mers of a sequence set,
+    used to size the counters before filling them.
+    @param number of bases of the set
+    @param k, size of the kmers
+    @return the bound
+*/
+inline uint64_t maxDistinctKmers(uint64_t nb_bases, uint8_t k){
+    return(k < 32 ? std::min(nb_bases, uint64_t(1) << (2 * k)) : nb_bases);
+}
+// dense counter, indexed by the 2 bit kmer (small k only)
+using dense_counter = std::vector<uint32_t>;
 // pair vector
 using pair_vector = std::vector<std::pair<uint64_t,uint64_t> > ;
-// type of sequence set
-using sequence_set_type = StringSet<DnaString> ;
+// type of the whole read set, when it is loaded in memory (3 bits per base)
+using read_set_type = StringSet<String<Dna5, Packed<> > > ;
 // vector of boolean used to keep track of kmer positions count.
 using bit_field = std::vector<bool>  ;
 // config file parameter map
@@ -203,11 +442,81 @@ inline uint64_t vectorSum(TVector vec)
     return(res);
 }
 
+/**
+    Dimer counts of a k-mer window, and the sum of v * (v - 1) over them,
+    the DUST score numerator (see haveLowComplexity). When the window slides
+    along a sequence, both are updated in O(1) per base (see dustSlide),
+    instead of counting the k - 1 dimers of each k-mer again.
+*/
+struct dust_window_t{
+    uint32_t counts[16] = {0}; // 16 possibles dimers
+    uint64_t sum = 0;
+};
+
+/**
+    Empty a DUST window, after an ambiguous base.
+    @param the window
+*/
+inline void dustReset(dust_window_t & window){
+    window = dust_window_t();
+}
+
+/**
+    Add a dimer to a DUST window: v * (v - 1) grows by 2v.
+    @param the window
+    @param the dimer, as 2 * 2 bits
+*/
+inline void dustAdd(dust_window_t & window, uint8_t dimer){
+    window.sum += 2 * window.counts[dimer];
+    window.counts[dimer]++;
+}
+
+/**
+    Remove a dimer from a DUST window.
+    @param the window
+    @param the dimer, as 2 * 2 bits
+*/
+inline void dustRemove(dust_window_t & window, uint8_t dimer){
+    window.counts[dimer]--;
+    window.sum -= 2 * window.counts[dimer];
+}
+
+/**
+    Slide a DUST window by one base: the new dimer comes in and, once the
+    window holds k bases, the first dimer of the previous k-mer goes out.
+    Must be called before the base is added to the k-mer.
+    @param the window
+    @param the previous k-mer, in 2 bit representation
+    @param the new base
+    @param number of unambiguous bases before the new one
+    @param k, size of the kmers
+*/
+inline void dustSlide(dust_window_t & window, uint64_t kmer, uint8_t c, uint64_t valid, uint8_t k){
+    if(k < 2 or valid == 0)
+        return;
+    if(valid >= k)
+        dustRemove(window, (kmer >> (2 * (k - 2))) & 15);
+    dustAdd(window, ((kmer << 2) | c) & 15);
+}
+
+/**
+    Check the DUST score of a window against the low complexity threshold.
+    @param the window, holding the dimers of a k-mer
+    @param k the size of the k-mer
+    @param threshold for the low complexity filter.
+    @return True if the k-mer contains low complexity region
+*/
+inline bool dustIsLow(dust_window_t const & window, uint8_t k, float threshold){
+    float s =  window.sum / float(2 * (k-2));
+    return s>= threshold;
+}
+
 /**
     Check the complexity of a kmer
     Our score is derived from 2006 DUST publication on
     fast DNA sequence masking
     https://doi.org/10.1089/cmb.2006.13.1028
+    K-mers of a sequence are better checked with a sliding dust_window_t.
     @param the kmer to test, in 2 bit representation, cast as an uint64_t int
     @param k the size of said kmer
     @param threshold for the low complexity filter.
@@ -215,220 +524,3640 @@ inline uint64_t vectorSum(TVector vec)
 */
 inline  bool haveLowComplexity(uint64_t kmer, uint8_t k, float threshold){
     
-    uint64_t counts[16] = { 0 }; // 16 possibles dimers
+    dust_window_t window;
     // reading using sliding window of 2
     for(int i = 0; i < k-1; i++){
         // storing dimers as 2 * 2 bits
-        uint8_t c =  kmer & 15;
+        dustAdd(window, kmer & 15);
         // removing last element of the k-mer
         kmer >>=2;
-        // updating value of dimer count
-        counts[c]++;
     }
+    return(dustIsLow(window, k, threshold));
+}
+
+
+/**
+    Forbidden k-mers. A blocked Bloom filter, where the bits of a k-mer
+    all fall in the same cache line, answers most lookups with a single
+    memory access. Only the k-mers it lets through are searched in the
+    exact sorted list, so large sets (all the k-mers of a host genome)
+    cost about as much as small ones in the counting loops. Filters built
+    from a reference store canonical k-mers (see canonicalKmer), one entry
+    forbidding both orientations; k-mer lists are kept as given.
+*/
+struct kmer_filter_t{
+    uint8_t k = 0;                 // size of the k-mers, 0 if unknown
+    bool canonical = false;        // k-mers (and queries) in canonical form
+    uint64_t fingerprint = 0;      // of the reference it was built from, 0 for a k-mer list
+    std::vector<uint64_t> blocks;  // Bloom filter, BLOOM_BLOCK_WORDS words per block
+    std::vector<uint64_t> kmers;   // the forbidden k-mers, sorted
+};
+
+/**
+    Canonical form of a k-mer: the smaller of the k-mer and its reverse
+    complement.
+    @param the kmer, in 2 bit representation
+    @param k, size of the kmer
+    @return the canonical kmer
+*/
+inline uint64_t canonicalKmer(uint64_t kmer, uint8_t k){
+    // complement, then reverse the order of the 2 bit bases
+    uint64_t reverse = ~kmer;
+    reverse = ((reverse >> 2) & 0x3333333333333333ULL) | ((reverse & 0x3333333333333333ULL) << 2);
+    reverse = ((reverse >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((reverse & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    reverse = ((reverse >> 8) & 0x00FF00FF00FF00FFULL) | ((reverse & 0x00FF00FF00FF00FFULL) << 8);
+    reverse = ((reverse >> 16) & 0x0000FFFF0000FFFFULL) | ((reverse & 0x0000FFFF0000FFFFULL) << 16);
+    reverse = (reverse >> 32) | (reverse << 32);
+    reverse >>= 64 - 2 * k;
+    return(std::min(kmer, reverse));
+}
+
+/**
+    Mix the bits of a k-mer (splitmix64 finalizer), for the Bloom filter.
+    @param the value to hash
+    @return the hash
+*/
+inline uint64_t mixHash(uint64_t value){
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return(value ^ (value >> 31));
+}
+
+/**
+    First word of the Bloom filter block of a k-mer.
+    @param the filter, with at least one block
+    @param hash of the k-mer, see mixHash
+    @return offset of the block in filter.blocks
+*/
+inline uint64_t bloomBlock(kmer_filter_t const & filter, uint64_t hash){
+    uint64_t nb_blocks = filter.blocks.size() / BLOOM_BLOCK_WORDS;
+    return(((hash >> 32) * nb_blocks >> 32) * BLOOM_BLOCK_WORDS);
+}
+
+/**
+    Check if a k-mer may be in the Bloom filter (false positives happen,
+    false negatives do not).
+    @param the filter
+    @param the kmer, in 2 bit representation
+    @return False if the k-mer is surely not in the filter
+*/
+inline bool bloomContains(kmer_filter_t const & filter, uint64_t kmer){
+    uint64_t hash = mixHash(kmer);
+    uint64_t const * block = filter.blocks.data() + bloomBlock(filter, hash);
+    // bit positions in the block, 9 bits each, from a second hash
+    uint64_t bits = mixHash(hash);
+    for(uint8_t i = 0; i < BLOOM_NB_HASH; i++, bits >>= 9){
+        if(not ((block[(bits & 511) / 64] >> (bits % 64)) & 1))
+            return(false);
+    }
+    return(true);
+}
+
+/**
+    Sort the k-mers of a filter and fill its Bloom filter, in parallel.
+    @param the filter, with its k-mers (duplicates allowed)
+    @param number of thread to use
+*/
+void buildKmerFilter(kmer_filter_t & filter, uint64_t nb_thread){
+    omp_set_num_threads(nb_thread);
+    std::sort(filter.kmers.begin(), filter.kmers.end());
+    filter.kmers.erase(std::unique(filter.kmers.begin(), filter.kmers.end()), filter.kmers.end());
+    uint64_t nb_blocks = std::max<uint64_t>(1, (filter.kmers.size() * BLOOM_BITS_PER_KMER + 511) / 512);
+    filter.blocks.assign(nb_blocks * BLOOM_BLOCK_WORDS, 0);
+    #pragma omp parallel for schedule(static)
+    for(uint64_t i = 0; i < filter.kmers.size(); i++){
+        uint64_t hash = mixHash(filter.kmers[i]);
+        uint64_t * block = filter.blocks.data() + bloomBlock(filter, hash);
+        uint64_t bits = mixHash(hash);
+        for(uint8_t j = 0; j < BLOOM_NB_HASH; j++, bits >>= 9){
+            uint64_t bit = uint64_t(1) << (bits % 64);
+            #pragma omp atomic
+            block[(bits & 511) / 64] |= bit;
+        }
+    }
+}
+
+/**
+    Check if the kmer is autorised or not
+    @param the kmer to test, in 2 bit representation, cast as an uint64_t int
+    @param the filter of forbidden kmers
+    @return True if the kmer is forbidden (or its reverse complement, for a canonical filter)
+*/
+inline  bool isForbiddenKmer(uint64_t kmer, kmer_filter_t const & kmer_set){
+    if(kmer_set.kmers.empty())
+        return(false);
+    if(kmer_set.canonical)
+        kmer = canonicalKmer(kmer, kmer_set.k);
+    return(bloomContains(kmer_set, kmer) and std::binary_search(kmer_set.kmers.begin(), kmer_set.kmers.end(), kmer));
+}
+
+/**
+    Parse a kmer list file and return a kmer filter.
+    @param the file containging a list of kmer to exclude, one per line
+    @param number of thread to use
+    @return A kmer filter
+*/
+kmer_filter_t parse_kmer_list(std::string kmer_file, uint64_t nb_thread){
+    
+    kmer_filter_t kmer_set;
+
+    std::ifstream kmer_file_stream(kmer_file);
+    // parsing file
+    if( kmer_file_stream.is_open()) {
+        for( std::string line; getline( kmer_file_stream, line );){
+            while(not line.empty() and std::isspace(line.back()))
+                line.pop_back();
+            if(line.empty())
+                continue;
+            // inserting new kmer
+            uint64_t kmer = 0;
+            for(char c: line)
+                kmer = kmer << 2 | ordValue(Dna(c));
+            kmer_set.kmers.push_back(kmer);
+            if(kmer_set.kmers.size() == 1)
+                kmer_set.k = line.size();
+            else if(kmer_set.k != line.size())
+                kmer_set.k = 0;
+        }
+        kmer_file_stream.close();
+    }
+    else{
+        std::cout << "/!\\ COULD NOT OPEN EXCLUDED KMER FILE, must quit\n";
+        exit(1);
+    }
+    buildKmerFilter(kmer_set, nb_thread);
+    return(kmer_set);
+}
+
+/**
+    Return the solid kmers. Kmer with count over threshold will be kept.
+    @param kmer count map (see count_kmer and error count)
+    @param The minimum abundance of the kmers to return
+    @return vector of pair containing the solids kmers and their associated count.
+*/
+pair_vector get_solid_kmers(counter & count_map, uint64_t solid_km){
+
+    pair_vector kmer_vec;
+    kmer_vec.reserve(count_map.size());
+    for(auto const & kmer_count: count_map)
+        kmer_vec.emplace_back(kmer_count.first, kmer_count.second);
+    std::sort(kmer_vec.begin(), kmer_vec.end(), [](auto x, auto y){ return x.second > y.second;} );
+    uint64_t limit = 0;
+    // Finding the position in the vector where kmer count is no longer high enough
+    for(auto kmer_count: kmer_vec){
+        if(kmer_count.second >= solid_km ){
+            limit ++;
+        }
+        else{
+            break;
+        }
+    }
+    kmer_vec.resize(limit);
+    return(kmer_vec);
+}
+
+/**
+    Return the first top kmers, ranked by count, descending.
+    @param kmer count map (see count_kmer and error count)
+    @param number of kmers to return
+    @return vector of pair containing the most frequent kmers and their associated count.
+*/
+pair_vector get_most_frequent(counter & count_map, uint64_t limit){
+
+    pair_vector kmer_vec;
+    kmer_vec.reserve(count_map.size());
+    for(auto const & kmer_count: count_map)
+        kmer_vec.emplace_back(kmer_count.first, kmer_count.second);
+    std::sort(kmer_vec.begin(), kmer_vec.end(), [](auto x, auto y){ return x.second > y.second;} );
+    if(kmer_vec.size() > limit){
+        kmer_vec.resize(limit);
+    }
+    return(kmer_vec);
+}
+
+/**
+    Return the solid kmers of a dense counter (see dense_count_kmers).
+    @param dense kmer count
+    @param The minimum abundance of the kmers to return
+    @return vector of pair containing the solids kmers and their associated count.
+*/
+pair_vector get_solid_kmers(dense_counter const & count_array, uint64_t solid_km){
+
+    pair_vector kmer_vec;
+    for(uint64_t kmer = 0; kmer < count_array.size(); kmer++){
+        if(count_array[kmer] > 0 and count_array[kmer] >= solid_km)
+            kmer_vec.emplace_back(kmer, count_array[kmer]);
+    }
+    std::sort(kmer_vec.begin(), kmer_vec.end(), [](auto x, auto y){ return x.second > y.second;} );
+    return(kmer_vec);
+}
+
+/**
+    Return the first top kmers of a dense counter (see dense_count_kmers).
+    Only the top kmers are sorted, after a partial selection.
+    @param dense kmer count
+    @param number of kmers to return
+    @return vector of pair containing the most frequent kmers and their associated count.
+*/
+pair_vector get_most_frequent(dense_counter const & count_array, uint64_t limit){
+
+    pair_vector kmer_vec;
+    for(uint64_t kmer = 0; kmer < count_array.size(); kmer++){
+        if(count_array[kmer] > 0)
+            kmer_vec.emplace_back(kmer, count_array[kmer]);
+    }
+    auto by_count = [](auto x, auto y){ return x.second > y.second;};
+    if(kmer_vec.size() > limit){
+        std::nth_element(kmer_vec.begin(), kmer_vec.begin() + limit, kmer_vec.end(), by_count);
+        kmer_vec.resize(limit);
+    }
+    std::sort(kmer_vec.begin(), kmer_vec.end(), by_count);
+    return(kmer_vec);
+}
+
+
+/**
+    Sampled read ends, packed 2 bits per base in one contiguous buffer,
+    so a sample of sn reads does not cost 2 * sn small allocations and
+    k-mers are read a word at a time. Every sequence has its own slot of
+    stride words, starting on a word boundary: slot i starts at word
+    i * stride, and a slot can be overwritten in place by the reservoir.
+    Ambiguous bases are stored as A, with their bit set in a separate mask.
+*/
+struct packed_sample_t{
+    uint64_t stride = 0;             // words per slot (32 bases per word)
+    std::vector<uint64_t> bases;     // 2 bit bases, first base in the lowest bits
+    std::vector<uint64_t> ambiguous; // 1 bit per base, set for ambiguous bases
+    std::vector<uint32_t> lengths;   // length of each sequence
+};
+
+/**
+    Read only view of a sequence of a packed sample (see packedView).
+*/
+struct packed_view_t{
+    const uint64_t * bases;
+    const uint64_t * ambiguous;
+    uint64_t size;
+    inline Dna5 operator[](uint64_t i) const{
+        if((ambiguous[i / 64] >> (i % 64)) & 1)
+            return(Dna5('N'));
+        return(Dna5(int((bases[i / 32] >> (2 * (i % 32))) & 3)));
+    }
+};
+
+/**
+    Prepare an empty packed sample.
+    @param the sample to initialise
+    @param maximum length of the stored sequences
+*/
+void initPacked(packed_sample_t & sample, uint64_t max_length){
+    sample.stride = std::max<uint64_t>((max_length + 31) / 32, 1);
+    sample.bases.clear();
+    sample.ambiguous.clear();
+    sample.lengths.clear();
+}
+
+inline uint64_t length(packed_sample_t const & sample){
+    return(sample.lengths.size());
+}
+
+inline uint64_t length(packed_view_t const & view){
+    return(view.size);
+}
+
+/**
+    View of a stored sequence.
+    @param the packed sample
+    @param the slot of the sequence
+    @return the view, valid until the sample grows
+*/
+inline packed_view_t packedView(packed_sample_t const & sample, uint64_t slot){
+    // the mask slot is half the size of the base slot, rounded up
+    return(packed_view_t{sample.bases.data() + slot * sample.stride,
+                         sample.ambiguous.data() + slot * ((sample.stride + 1) / 2),
+                         sample.lengths[slot]});
+}
+
+/**
+    Grow a packed sample by one slot, if needed, before storing a sequence.
+    @param the packed sample
+    @param the slot to write, at most the current number of sequences
+    @param length of the sequence to store
+*/
+inline void packedReserve(packed_sample_t & sample, uint64_t slot, uint64_t seq_len){
+    if(seq_len > sample.stride * 32)
+        throw std::runtime_error("Sequence longer than the sample slots");
+    if(slot == sample.lengths.size()){
+        sample.lengths.push_back(0);
+        sample.bases.resize(sample.lengths.size() * sample.stride);
+        sample.ambiguous.resize(sample.lengths.size() * ((sample.stride + 1) / 2));
+    }
+    sample.lengths[slot] = seq_len;
+}
+
+/**
+    Store a sequence (of chars or Dna5) in a slot of a packed sample.
+    @param the packed sample
+    @param the slot to write, at most the current number of sequences
+    @param the sequence
+*/
+template<typename TSequence>
+void packedStore(packed_sample_t & sample, uint64_t slot, TSequence const & seq){
+    uint64_t seq_len = length(seq);
+    packedReserve(sample, slot, seq_len);
+    uint64_t * bases = sample.bases.data() + slot * sample.stride;
+    uint64_t * ambiguous = sample.ambiguous.data() + slot * ((sample.stride + 1) / 2);
+    for(uint64_t i = 0; i < seq_len; i += 32){
+        uint64_t word = 0;
+        uint64_t mask = 0;
+        for(uint64_t j = 0; j < 32 and i + j < seq_len; j++){
+            uint8_t c = ordValue(Dna5(seq[i + j]));
+            if(c > 3)
+                mask |= uint64_t(1) << j;
+            else
+                word |= uint64_t(c) << (2 * j);
+        }
+        bases[i / 32] = word;
+        // 64 bits of mask per word, filled two base words at a time
+        if(i % 64 == 0)
+            ambiguous[i / 64] = mask;
+        else
+            ambiguous[i / 64] |= mask << 32;
+    }
+}
+
+/**
+    Copy a sequence of another packed sample, word by word.
+    @param the packed sample
+    @param the slot to write, at most the current number of sequences
+    @param view of the sequence to copy
+*/
+void packedStore(packed_sample_t & sample, uint64_t slot, packed_view_t const & seq){
+    packedReserve(sample, slot, seq.size);
+    std::copy(seq.bases, seq.bases + (seq.size + 31) / 32, sample.bases.begin() + slot * sample.stride);
+    std::copy(seq.ambiguous, seq.ambiguous + (seq.size + 63) / 64, sample.ambiguous.begin() + slot * ((sample.stride + 1) / 2));
+}
+
+
+/**
+    Apply a function to every k-mer of a sequence passing the filters
+    (no ambiguous base, not low complexity, not forbidden).
+    Ambiguous bases (N) reset the k-mer window, no k-mer spans them.
+    The DUST score follows the k-mer window (see dustSlide).
+    @param the sequence (Dna5)
+    @param k, size of the kmers
+    @param threshold of the low complexity filter
+    @param set of forbidden kmers
+    @param function called with each kmer, in 2 bit representation
+*/
+template<typename TSequence, typename TFunction>
+inline void forEachKmer(TSequence const & seq, uint8_t k, float threshold, kmer_filter_t const & kmer_set, TFunction && function){
+    uint64_t base = std::pow(2,(2*k))-1;
+    uint64_t n = 0;
+    uint64_t valid = 0; // number of consecutive unambiguous bases
+    dust_window_t window;
+    for(uint64_t i = 0; i < length(seq); i++){
+        uint8_t c = ordValue(seq[i]);
+        if(c > 3){
+            valid = 0;
+            dustReset(window);
+            continue;
+        }
+        dustSlide(window, n, c, valid, k);
+        n = ((n << 2) | c) & base;
+        valid++;
+        if(valid >= k and not dustIsLow(window,k,threshold) and not isForbiddenKmer(n,kmer_set)){
+            function(n);
+        }
+    }
+}
+
+/**
+    Same as above, for a sequence of a packed sample: bases are shifted
+    out of whole words, and the ambiguity mask is checked 64 bases at a time.
+*/
+template<typename TFunction>
+inline void forEachKmer(packed_view_t const & seq, uint8_t k, float threshold, kmer_filter_t const & kmer_set, TFunction && function){
+    uint64_t base = k < 32 ? (uint64_t(1) << (2 * k)) - 1 : ~uint64_t(0);
+    uint64_t n = 0;
+    uint64_t valid = 0; // number of consecutive unambiguous bases
+    dust_window_t window;
+    for(uint64_t i = 0; i < seq.size; i += 32){
+        uint64_t word = seq.bases[i / 32];
+        uint64_t mask = seq.ambiguous[i / 64] >> (i % 64);
+        uint64_t word_end = std::min<uint64_t>(32, seq.size - i);
+        for(uint64_t j = 0; j < word_end; j++, word >>= 2, mask >>= 1){
+            if(mask & 1){
+                valid = 0;
+                dustReset(window);
+                continue;
+            }
+            dustSlide(window, n, word & 3, valid, k);
+            n = ((n << 2) | (word & 3)) & base;
+            valid++;
+            if(valid >= k and not dustIsLow(window,k,threshold) and not isForbiddenKmer(n,kmer_set)){
+                function(n);
+            }
+        }
+    }
+}
+
+/**
+    Add (or remove) the k-mers of a sequence to a counter.
+    K-mers whose count drops to zero are removed from the counter.
+    @param the counter to update
+    @param the sequence
+    @param k, size of the kmers
+    @param threshold of the low complexity filter
+    @param set of forbidden kmers
+    @param True to remove the k-mers instead of adding them
+*/
+template<typename TSequence>
+void updateKmerCount(counter & count, TSequence const & seq, uint8_t k, float threshold, kmer_filter_t const & kmer_set, bool remove = false){
+    if(remove){
+        forEachKmer(seq, k, threshold, kmer_set, [&count](uint64_t n){
+            if(--count[n] == 0)
+                count.erase(n);
+        });
+    }
+    else{
+        forEachKmer(seq, k, threshold, kmer_set, [&count](uint64_t n){
+            count[n] += 1;
+        });
+    }
+}
+
+
+/**
+    Minimal byte input interface, so the ends-only parser does not
+    need to know where bytes come from (plain file, decompressor...).
+*/
+struct byte_source_t{
+    virtual ~byte_source_t(){}
+    // Read at most size bytes into buffer, return 0 at end of input.
+    virtual size_t read(char * buffer, size_t size) = 0;
+};
 
-    float s = 0;
-    size_t sum = 0;
-    for(auto v:counts){
-        sum +=  v * (v-1);  
+/**
+    Byte source reading an uncompressed file descriptor.
+*/
+struct fd_source_t: byte_source_t{
+    int fd;
+    fd_source_t(int fd): fd(fd){}
+    ~fd_source_t(){ close(fd); }
+    size_t read(char * buffer, size_t size){
+        ssize_t n;
+        do{
+            n = ::read(fd, buffer, size);
+        } while(n < 0 and errno == EINTR);
+        if(n < 0){
+            throw std::runtime_error("Error while reading input file");
+        }
+        return(n);
+    }
+};
+
+/**
+    Bounded blocking queue, used to pass buffers between threads.
+    Producers block when the queue is full (back-pressure), consumers
+    block when it is empty. Once closed, push fails and pop drains
+    the remaining items.
+*/
+template<typename TItem>
+struct bounded_queue_t{
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<TItem> items;
+    size_t capacity;
+    bool closed = false;
+
+    bounded_queue_t(size_t capacity): capacity(capacity){}
+
+    bool push(TItem item){
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]{ return closed or items.size() < capacity; });
+        if(closed)
+            return(false);
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return(true);
+    }
+
+    bool pop(TItem & item){
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]{ return closed or not items.empty(); });
+        if(items.empty())
+            return(false);
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return(true);
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+// Buffers of decompressed data, passed from a decoding thread to the parser.
+using chunk_queue_t = bounded_queue_t<std::vector<char> >;
+
+/**
+    Byte source fed by a producer thread, so decoding the input overlaps
+    with parsing and sampling.
+*/
+struct threaded_source_t: byte_source_t{
+    chunk_queue_t queue;
+    std::thread producer;
+    std::exception_ptr error;
+    std::vector<char> current;
+    size_t current_pos = 0;
+
+    // The producer must push chunks into the queue, and return at the end of input.
+    template<typename TProducer>
+    threaded_source_t(TProducer produce): queue(DECODED_QUEUE_SIZE){
+        producer = std::thread([this, produce]{
+            try{
+                produce(queue);
+            }
+            catch(...){
+                error = std::current_exception();
+            }
+            queue.close();
+        });
+    }
+    ~threaded_source_t(){
+        queue.close();
+        producer.join();
+    }
+    size_t read(char * buffer, size_t size){
+        while(current_pos == current.size()){
+            current_pos = 0;
+            if(not queue.pop(current)){
+                current.clear();
+                if(error)
+                    std::rethrow_exception(error);
+                return(0);
+            }
+        }
+        size_t n = std::min(size, current.size() - current_pos);
+        memcpy(buffer, current.data() + current_pos, n);
+        current_pos += n;
+        return(n);
+    }
+};
+
+/**
+    Check if a path is a regular file. Other files (pipes...) must not be
+    opened just to be inspected, that would disturb their writer.
+    @param the path
+    @return True for regular files
+*/
+bool isRegularFile(std::string path){
+    struct stat st;
+    return(path != STDIN_NAME and stat(path.c_str(), &st) == 0 and S_ISREG(st.st_mode));
+}
+
+/**
+    Read a little endian 32 bits integer.
+    @param pointer to the first byte
+    @return the integer
+*/
+inline uint32_t readLe32(const void * data){
+    const unsigned char * bytes = (const unsigned char *) data;
+    return(bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24);
+}
+
+/**
+    Check the magic bytes at the start of a file for a supported compression.
+    @param the file descriptor
+    @return True if the file is gzip (or BGZF) or Zstandard compressed
+*/
+bool hasCompressedMagic(int fd){
+    unsigned char magic[4] = {0, 0, 0, 0};
+    if(pread(fd, magic, 4, 0) != 4)
+        return(false);
+    return((magic[0] == 0x1f and magic[1] == 0x8b) or readLe32(magic) == ZSTD_FRAME_MAGIC
+           or (readLe32(magic) & 0xFFFFFFF0) == 0x184D2A50);
+}
+
+/**
+    Batch of records travelling in a pipeline (see runPipeline).
+*/
+template<typename TRecord>
+struct record_batch_t{
+    std::vector<TRecord> records;
+    size_t size = 0;
+};
+
+/**
+    Run a two stage pipeline: a producer thread fills batches of records,
+    while the calling thread consumes them. Batches go through bounded
+    queues and are recycled, so the producer waits when the consumer lags
+    behind (back-pressure) and memory stays bounded.
+    @param producer, fills the record it gets and returns False at the end of input
+    @param consumer, called on each record in input order
+*/
+template<typename TRecord, typename TProducer, typename TConsumer>
+void runPipeline(TProducer produce, TConsumer consume){
+    using batch_t = record_batch_t<TRecord>;
+    bounded_queue_t<batch_t> filled(PIPELINE_QUEUE_SIZE);
+    bounded_queue_t<batch_t> free(PIPELINE_QUEUE_SIZE + 2);
+    for(size_t i = 0; i < PIPELINE_QUEUE_SIZE + 2; i++){
+        batch_t batch;
+        batch.records.resize(PIPELINE_BATCH_SIZE);
+        free.push(std::move(batch));
+    }
+    std::exception_ptr error;
+    std::thread producer([&]{
+        try{
+            batch_t batch;
+            bool more = true;
+            while(more and free.pop(batch)){
+                batch.size = 0;
+                while(batch.size < batch.records.size() and (more = produce(batch.records[batch.size])))
+                    batch.size++;
+                if(batch.size > 0 and not filled.push(std::move(batch)))
+                    break;
+            }
+        }
+        catch(...){
+            error = std::current_exception();
+        }
+        filled.close();
+    });
+    try{
+        batch_t batch;
+        while(filled.pop(batch)){
+            for(size_t i = 0; i < batch.size; i++)
+                consume(batch.records[i]);
+            free.push(std::move(batch));
+        }
+    }
+    catch(...){
+        filled.close();
+        free.close();
+        producer.join();
+        throw;
+    }
+    producer.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+
+/**
+    Byte source replaying bytes already read from another source before
+    the rest of it. Used to sniff the format of non seekable inputs (pipes).
+*/
+struct peek_source_t: byte_source_t{
+    std::unique_ptr<byte_source_t> source;
+    std::string head;
+    size_t head_pos = 0;
+
+    peek_source_t(byte_source_t * source): source(source){}
+    // Make sure the first size bytes (if any) are available in head.
+    std::string const & peek(size_t size){
+        while(head.size() < size){
+            char buffer[64];
+            size_t n = source->read(buffer, std::min(size - head.size(), sizeof(buffer)));
+            if(n == 0)
+                break;
+            head.append(buffer, n);
+        }
+        return(head);
+    }
+    size_t read(char * buffer, size_t size){
+        if(head_pos < head.size()){
+            size_t n = std::min(size, head.size() - head_pos);
+            memcpy(buffer, head.data() + head_pos, n);
+            head_pos += n;
+            return(n);
+        }
+        return(source->read(buffer, size));
+    }
+};
+
+/**
+    Read exactly size bytes, unless the end of input is reached.
+    @param the byte source
+    @param destination buffer
+    @param number of bytes to read
+    @return the number of bytes actually read
+*/
+size_t readFully(byte_source_t & source, char * buffer, size_t size){
+    size_t done = 0;
+    while(done < size){
+        size_t n = source.read(buffer + done, size - done);
+        if(n == 0)
+            break;
+        done += n;
+    }
+    return(done);
+}
+
+/**
+    Check if the first bytes of an input are a gzip header.
+    @param the first bytes of the input
+    @return True if the input is gzip (or BGZF) compressed
+*/
+inline bool isGzipHeader(std::string const & head){
+    return(head.size() >= 2 and uint8_t(head[0]) == 0x1f and uint8_t(head[1]) == 0x8b);
+}
+
+/**
+    Check if the first bytes of an input are a BGZF header (blocked gzip,
+    as written by bgzip or samtools).
+    @param the first bytes of the input
+    @return True if the first block carries the BGZF 'BC' extra field
+*/
+inline bool isBgzfHeader(std::string const & head){
+    return(isGzipHeader(head) and head.size() >= 18 and head[3] & 4 and head[12] == 'B' and head[13] == 'C');
+}
+
+#if SEQAN_HAS_ZLIB
+/**
+    Decompress a BGZF file, inflating batches of independent blocks in parallel.
+    @param the compressed byte source
+    @param number of inflating threads
+    @param the queue receiving the decompressed batches
+*/
+void inflateBgzf(byte_source_t & input, uint64_t nb_thread, chunk_queue_t & queue){
+    const size_t batch_size = BGZF_BATCH_PER_THREAD * nb_thread;
+    std::vector<std::vector<char> > blocks;
+    std::vector<uint32_t> block_sizes;
+    bool eof = false;
+    while(not eof){
+        // Reading a batch of compressed blocks, sequentially
+        blocks.clear();
+        block_sizes.clear();
+        uint64_t total = 0;
+        while(blocks.size() < batch_size){
+            unsigned char header[12];
+            size_t n = readFully(input, (char *) header, 12);
+            if(n == 0){
+                eof = true;
+                break;
+            }
+            if(n < 12 or header[0] != 0x1f or header[1] != 0x8b or not (header[3] & 4)){
+                throw std::runtime_error("Invalid BGZF block header");
+            }
+            uint16_t xlen = header[10] | header[11] << 8;
+            std::vector<char> extra(xlen);
+            if(readFully(input, extra.data(), xlen) < xlen)
+                throw std::runtime_error("Truncated BGZF block");
+            int64_t bsize = -1;
+            for(uint16_t i = 0; i + 4 <= xlen; ){
+                uint16_t slen = uint8_t(extra[i+2]) | uint8_t(extra[i+3]) << 8;
+                if(extra[i] == 'B' and extra[i+1] == 'C' and slen == 2 and i + 6 <= xlen)
+                    bsize = uint8_t(extra[i+4]) | uint8_t(extra[i+5]) << 8;
+                i += 4 + slen;
+            }
+            if(bsize < 0)
+                throw std::runtime_error("BGZF block without size field");
+            // compressed data, followed by CRC32 and ISIZE, checked before sizing the block
+            if(uint64_t(bsize) + 1 < 12 + uint64_t(xlen) + 8)
+                throw std::runtime_error("Truncated BGZF block");
+            size_t remaining = bsize + 1 - 12 - xlen;
+            std::vector<char> block(remaining);
+            if(readFully(input, block.data(), remaining) < remaining)
+                throw std::runtime_error("Truncated BGZF block");
+            const unsigned char * trailer = (const unsigned char *) block.data() + remaining - 4;
+            uint32_t isize = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | uint32_t(trailer[3]) << 24;
+            blocks.push_back(std::move(block));
+            block_sizes.push_back(isize);
+            total += isize;
+        }
+
+        // Inflating the blocks in parallel, each one at its own offset
+        std::vector<char> output(total);
+        std::vector<uint64_t> offsets(blocks.size() + 1, 0);
+        for(size_t i = 0; i < blocks.size(); i++)
+            offsets[i+1] = offsets[i] + block_sizes[i];
+        bool failed = false;
+        #pragma omp parallel for num_threads(nb_thread) schedule(dynamic) reduction(||:failed)
+        for(int64_t i = 0; i < int64_t(blocks.size()); i++){
+            z_stream strm;
+            memset(&strm, 0, sizeof(strm));
+            inflateInit2(&strm, -15);
+            strm.next_in   = (Bytef *) blocks[i].data();
+            strm.avail_in  = blocks[i].size() - 8;
+            strm.next_out  = (Bytef *) output.data() + offsets[i];
+            strm.avail_out = block_sizes[i];
+            int ret = inflate(&strm, Z_FINISH);
+            inflateEnd(&strm);
+            const unsigned char * trailer = (const unsigned char *) blocks[i].data() + blocks[i].size() - 8;
+            uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | uint32_t(trailer[3]) << 24;
+            failed = failed or ret != Z_STREAM_END or strm.avail_out != 0
+                     or crc != crc32(0, (const Bytef *) output.data() + offsets[i], block_sizes[i]);
+        }
+        if(failed)
+            throw std::runtime_error("Corrupted BGZF block");
+        if(not output.empty() and not queue.push(std::move(output)))
+            return;
+    }
+}
+
+/**
+    Decompress a plain gzip file (possibly multi-member) in a pipelined fashion.
+    Inflating a plain gzip stream is inherently sequential, but running it in
+    its own thread lets it overlap with parsing and sampling.
+    @param the compressed byte source
+    @param the queue receiving the decompressed chunks
+*/
+void inflateGzip(byte_source_t & input, chunk_queue_t & queue){
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    inflateInit2(&strm, 15 + 32);
+    std::vector<char> compressed(READ_BUFFER_SIZE);
+    std::vector<char> output(READ_BUFFER_SIZE);
+    strm.next_out  = (Bytef *) output.data();
+    strm.avail_out = output.size();
+    bool in_member = false;
+    while(true){
+        if(strm.avail_in == 0){
+            size_t n = input.read(compressed.data(), compressed.size());
+            if(n == 0)
+                break;
+            strm.next_in  = (Bytef *) compressed.data();
+            strm.avail_in = n;
+        }
+        in_member = true;
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END){
+            // concatenated members are allowed by the gzip format
+            in_member = false;
+            inflateReset(&strm);
+        }
+        else if(ret != Z_OK and ret != Z_BUF_ERROR){
+            inflateEnd(&strm);
+            throw std::runtime_error("Corrupted gzip input");
+        }
+        if(strm.avail_out == 0){
+            if(not queue.push(std::move(output))){
+                inflateEnd(&strm);
+                return;
+            }
+            output = std::vector<char>(READ_BUFFER_SIZE);
+            strm.next_out  = (Bytef *) output.data();
+            strm.avail_out = output.size();
+        }
+    }
+    inflateEnd(&strm);
+    if(in_member)
+        throw std::runtime_error("Truncated gzip input");
+    output.resize(output.size() - strm.avail_out);
+    if(not output.empty())
+        queue.push(std::move(output));
+}
+#endif
+
+/**
+    Check if the first bytes of an input are a Zstandard frame, or a
+    skippable frame (some writers start their output with one).
+    @param the first bytes of the input
+    @return True if the input is Zstandard compressed
+*/
+inline bool isZstdHeader(std::string const & head){
+    return(head.size() >= 4 and (readLe32(head.data()) == ZSTD_FRAME_MAGIC or (readLe32(head.data()) & 0xFFFFFFF0) == 0x184D2A50));
+}
+
+#if ADAPTFINDER_HAS_ZSTD
+/**
+    Independent frame of a Zstandard file.
+*/
+struct zstd_frame_t{
+    uint64_t offset;               // offset of the compressed frame in the file
+    uint64_t compressed_size;
+    uint64_t decompressed_offset;  // offset of its content in the decompressed stream
+    uint64_t decompressed_size;
+};
+
+/**
+    Read the seek table of a file written in the Zstandard seekable format
+    (zstd contrib, t2sz...): a skippable frame at the end of the file listing
+    the size of every frame.
+    @param the file descriptor
+    @param size of the file
+    @return the frames, empty if the file has no valid seek table
+*/
+std::vector<zstd_frame_t> readSeekTable(int fd, uint64_t file_size){
+    std::vector<zstd_frame_t> frames;
+    unsigned char footer[9];
+    if(file_size < 17 or pread(fd, footer, 9, file_size - 9) != 9 or readLe32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+        return(frames);
+    uint64_t nb_frame = readLe32(footer);
+    uint64_t entry_size = footer[4] & 0x80 ? 12 : 8;
+    uint64_t table_size = nb_frame * entry_size + 9;
+    if(table_size + 8 > file_size)
+        return(frames);
+    std::vector<unsigned char> table(table_size + 8);
+    if(pread(fd, table.data(), table.size(), file_size - table.size()) != ssize_t(table.size())
+       or readLe32(table.data()) != ZSTD_SEEK_TABLE_MAGIC or readLe32(table.data() + 4) != table_size)
+        return(frames);
+    uint64_t offset = 0;
+    uint64_t decompressed_offset = 0;
+    for(uint64_t i = 0; i < nb_frame; i++){
+        const unsigned char * entry = table.data() + 8 + i * entry_size;
+        frames.push_back({offset, readLe32(entry), decompressed_offset, readLe32(entry + 4)});
+        offset += frames.back().compressed_size;
+        decompressed_offset += frames.back().decompressed_size;
+    }
+    if(offset + table.size() != file_size)
+        frames.clear();   // the table does not describe this file
+    return(frames);
+}
+
+/**
+    List the independent frames of a Zstandard file, so that they can be
+    decompressed in parallel or on demand. The seek table is used when there
+    is one, otherwise frame headers are walked (pzstd output, concatenated
+    files...), which only touches the frame and block headers.
+    @param path to the input file
+    @return the frames, empty if the file is not made of several frames of known size
+*/
+std::vector<zstd_frame_t> listZstdFrames(std::string input_file){
+    std::vector<zstd_frame_t> frames;
+    if(not isRegularFile(input_file))
+        return(frames);
+    int fd = open(input_file.c_str(), O_RDONLY);
+    struct stat st;
+    unsigned char magic[4];
+    if(fd < 0 or fstat(fd, &st) != 0 or st.st_size < 4 or pread(fd, magic, 4, 0) != 4 or not isZstdHeader(std::string((char *) magic, 4))){
+        if(fd >= 0)
+            close(fd);
+        return(frames);
+    }
+    uint64_t file_size = st.st_size;
+    frames = readSeekTable(fd, file_size);
+    if(frames.empty()){
+        void * addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(addr != MAP_FAILED){
+            const char * data = (const char *) addr;
+            uint64_t offset = 0;
+            uint64_t decompressed_offset = 0;
+            while(offset < file_size){
+                if(file_size - offset >= 8 and (readLe32(data + offset) & 0xFFFFFFF0) == 0x184D2A50){
+                    offset += 8 + uint64_t(readLe32(data + offset + 4));
+                    continue;
+                }
+                size_t compressed_size = ZSTD_findFrameCompressedSize(data + offset, file_size - offset);
+                unsigned long long decompressed_size = ZSTD_getFrameContentSize(data + offset, file_size - offset);
+                if(ZSTD_isError(compressed_size) or decompressed_size == ZSTD_CONTENTSIZE_UNKNOWN
+                   or decompressed_size == ZSTD_CONTENTSIZE_ERROR){
+                    frames.clear();
+                    break;
+                }
+                frames.push_back({offset, compressed_size, decompressed_offset, decompressed_size});
+                offset += compressed_size;
+                decompressed_offset += decompressed_size;
+            }
+            munmap(addr, file_size);
+        }
+    }
+    close(fd);
+    // a single frame can not be split, and huge frames would not fit a batch
+    bool usable = frames.size() > 1;
+    for(zstd_frame_t const & frame: frames)
+        usable = usable and frame.decompressed_size <= ZSTD_MAX_FRAME_SIZE;
+    if(not usable)
+        frames.clear();
+    return(frames);
+}
+
+/**
+    Decompress one frame of a Zstandard file.
+    @param the file descriptor
+    @param the frame
+    @param decompression context, one per thread
+    @param destination, of the decompressed size of the frame
+    @return False if the frame is truncated or corrupted
+*/
+bool decodeZstdFrame(int fd, zstd_frame_t const & frame, ZSTD_DCtx * dctx, char * output){
+    std::vector<char> compressed(frame.compressed_size);
+    if(pread(fd, compressed.data(), compressed.size(), frame.offset) != ssize_t(compressed.size()))
+        return(false);
+    size_t ret = ZSTD_decompressDCtx(dctx, output, frame.decompressed_size, compressed.data(), compressed.size());
+    return(not ZSTD_isError(ret) and ret == frame.decompressed_size);
+}
+
+/**
+    Decompress a Zstandard file made of independent frames, decompressing
+    batches of frames in parallel.
+    @param the file descriptor
+    @param the frames, see listZstdFrames
+    @param number of decompressing threads
+    @param the queue receiving the decompressed batches
+*/
+void decompressZstdFrames(int fd, std::vector<zstd_frame_t> const & frames, uint64_t nb_thread, chunk_queue_t & queue){
+    const size_t batch_size = ZSTD_BATCH_PER_THREAD * nb_thread;
+    std::vector<std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx *)> > contexts;
+    for(uint64_t i = 0; i < nb_thread; i++)
+        contexts.emplace_back(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    for(size_t first = 0; first < frames.size(); first += batch_size){
+        size_t last = std::min(first + batch_size, frames.size());
+        uint64_t base = frames[first].decompressed_offset;
+        std::vector<char> output(frames[last-1].decompressed_offset + frames[last-1].decompressed_size - base);
+        bool failed = false;
+        #pragma omp parallel for num_threads(nb_thread) schedule(dynamic) reduction(||:failed)
+        for(int64_t i = first; i < int64_t(last); i++){
+            failed = failed or not decodeZstdFrame(fd, frames[i], contexts[omp_get_thread_num()].get(),
+                                                   output.data() + frames[i].decompressed_offset - base);
+        }
+        if(failed)
+            throw std::runtime_error("Corrupted Zstandard frame");
+        if(not output.empty() and not queue.push(std::move(output)))
+            return;
+    }
+}
+
+/**
+    Decompress a Zstandard stream (single frame, pipe...) in a pipelined
+    fashion, see inflateGzip. Concatenated and skippable frames are handled.
+    @param the compressed byte source
+    @param the queue receiving the decompressed chunks
+*/
+void decompressZstd(byte_source_t & input, chunk_queue_t & queue){
+    std::unique_ptr<ZSTD_DStream, size_t(*)(ZSTD_DStream *)> stream(ZSTD_createDStream(), ZSTD_freeDStream);
+    ZSTD_initDStream(stream.get());
+    std::vector<char> compressed(READ_BUFFER_SIZE);
+    std::vector<char> output(READ_BUFFER_SIZE);
+    ZSTD_inBuffer in = {compressed.data(), 0, 0};
+    ZSTD_outBuffer out = {output.data(), output.size(), 0};
+    size_t remaining = 0;   // 0 once a frame is complete
+    bool eof = false;
+    while(true){
+        if(in.pos == in.size and not eof){
+            in.size = input.read(compressed.data(), compressed.size());
+            in.pos = 0;
+            eof = in.size == 0;
+        }
+        size_t in_pos = in.pos;
+        size_t out_pos = out.pos;
+        size_t ret = ZSTD_decompressStream(stream.get(), &out, &in);
+        if(ZSTD_isError(ret))
+            throw std::runtime_error("Corrupted Zstandard input");
+        if(in.pos != in_pos or out.pos != out_pos)
+            remaining = ret;
+        bool full = out.pos == out.size;
+        if(full){
+            if(not queue.push(std::move(output)))
+                return;
+            output = std::vector<char>(READ_BUFFER_SIZE);
+            out = {output.data(), output.size(), 0};
+        }
+        // at the end of input, the decoder is drained once it leaves room
+        if(eof and not full)
+            break;
+    }
+    if(remaining != 0)
+        throw std::runtime_error("Truncated Zstandard input");
+    output.resize(out.pos);
+    if(not output.empty())
+        queue.push(std::move(output));
+}
+#endif
+
+/**
+    Open an input file, picking the right byte source from its magic bytes.
+    Inputs are read (and decompressed) by a separate thread, BGZF blocks
+    and Zstandard frames being decompressed in parallel, overlapping with
+    the sampling stage.
+    Pipes are supported, the standard input being named "-".
+    @param path to the input file
+    @param number of threads available for decompression
+    @return the byte source, owned by the caller.
+*/
+std::unique_ptr<byte_source_t> openByteSource(std::string input_file, uint64_t nb_thread){
+    int fd = input_file == STDIN_NAME ? STDIN_FILENO : open(input_file.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "/!\\ COULD NOT OPEN INPUT FILE " << input_file << ", must quit\n";
+        exit(1);
+    }
+#if !SEQAN_HAS_ZLIB && !ADAPTFINDER_HAS_ZSTD
+    // only decompression runs on several threads
+    (void) nb_thread;
+#endif
+    // magic bytes are peeked, since pipes can not be read twice
+    std::shared_ptr<peek_source_t> raw(new peek_source_t(new fd_source_t(fd)));
+    std::string const & head = raw->peek(18);
+    if(isGzipHeader(head)){
+#if SEQAN_HAS_ZLIB
+        // the calling thread keeps parsing, the others inflate
+        uint64_t nb_inflate = std::max(uint64_t(1), nb_thread - 1);
+        if(isBgzfHeader(head)){
+            return(std::unique_ptr<byte_source_t>(new threaded_source_t([raw, nb_inflate](chunk_queue_t & queue){
+                inflateBgzf(*raw, nb_inflate, queue);
+            })));
+        }
+        return(std::unique_ptr<byte_source_t>(new threaded_source_t([raw](chunk_queue_t & queue){
+            inflateGzip(*raw, queue);
+        })));
+#else
+        throw std::runtime_error("Compressed input requires zlib support (SEQAN_HAS_ZLIB)");
+#endif
+    }
+    if(isZstdHeader(head)){
+#if ADAPTFINDER_HAS_ZSTD
+        // files made of several frames are decompressed in parallel
+        std::vector<zstd_frame_t> frames = listZstdFrames(input_file);
+        if(not frames.empty()){
+            uint64_t nb_decode = std::max(uint64_t(1), nb_thread - 1);
+            return(std::unique_ptr<byte_source_t>(new threaded_source_t([raw, fd, frames, nb_decode](chunk_queue_t & queue){
+                decompressZstdFrames(fd, frames, nb_decode, queue);
+            })));
+        }
+        return(std::unique_ptr<byte_source_t>(new threaded_source_t([raw](chunk_queue_t & queue){
+            decompressZstd(*raw, queue);
+        })));
+#else
+        throw std::runtime_error("Zstandard input requires zstd support (ADAPTFINDER_HAS_ZSTD)");
+#endif
+    }
+    // read-ahead thread, so reading overlaps with parsing
+    return(std::unique_ptr<byte_source_t>(new threaded_source_t([raw](chunk_queue_t & queue){
+        while(true){
+            std::vector<char> chunk(READ_BUFFER_SIZE);
+            chunk.resize(raw->read(chunk.data(), chunk.size()));
+            if(chunk.empty() or not queue.push(std::move(chunk)))
+                return;
+        }
+    })));
+}
+
+/**
+    Ends of a read, as raw characters. Only the first and last
+    cut_size bases are copied, the middle of the read is skipped.
+*/
+struct read_ends_t{
+    std::string id;       // read name, up to the first blank
+    std::string start;    // first bases of the read
+    std::string end;      // last bases of the read
+    std::string start_qual; // qualities of the first bases, empty if unknown
+    std::string end_qual;   // qualities of the last bases, empty if unknown
+    uint64_t length = 0;  // total read length
+};
+
+/**
+    Buffered FASTA / FASTQ parser keeping only the ends of each read.
+    Long reads are never materialised, nor converted to Dna5String.
+*/
+struct ends_parser_t{
+    byte_source_t * source;
+    std::vector<char> buffer;
+    size_t pos = 0;
+    size_t end = 0;
+    uint64_t cut_size;
+    bool qualities = false;  // keep the qualities of the ends
+    std::vector<uint8_t> packed; // BAM packed bases of the ends, reused between records
+
+    ends_parser_t(byte_source_t * source, uint64_t cut_size): source(source), buffer(READ_BUFFER_SIZE), cut_size(cut_size){}
+};
+
+/**
+    Make sure there is at least one byte available in the parser buffer.
+    @param the parser
+    @return False at end of input
+*/
+inline bool fillBuffer(ends_parser_t & parser){
+    if(parser.pos < parser.end){
+        return(true);
+    }
+    parser.pos = 0;
+    parser.end = parser.source->read(parser.buffer.data(), parser.buffer.size());
+    return(parser.end > 0);
+}
+
+/**
+    Consume a line, including its end of line.
+    @param the parser
+    @param (output) the line content up to the first blank, or nullptr to skip it.
+*/
+void readLine(ends_parser_t & parser, std::string * line){
+    bool keep = line != nullptr;
+    if(keep)
+        line->clear();
+    while(fillBuffer(parser)){
+        const char * first = parser.buffer.data() + parser.pos;
+        const char * last  = parser.buffer.data() + parser.end;
+        const char * eol   = (const char *) memchr(first, '\n', last - first);
+        const char * stop  = eol ? eol : last;
+        if(keep){
+            const char * blank = first;
+            while(blank < stop and not isspace(*blank))
+                blank++;
+            line->append(first, blank);
+            keep = blank == stop and eol == nullptr;
+        }
+        parser.pos = stop - parser.buffer.data();
+        if(eol){
+            parser.pos++;
+            return;
+        }
+    }
+}
+
+/**
+    Add a chunk of characters (bases or qualities) to the ends of a read.
+    @param (output) first characters of the read
+    @param (output) last characters of the read
+    @param pointer to the first character of the chunk
+    @param number of characters in the chunk
+    @param size of the ends to keep
+*/
+inline void appendEnds(std::string & start, std::string & end, const char * chars, size_t n, uint64_t cut_size){
+    if(start.size() < cut_size){
+        start.append(chars, std::min(n, cut_size - start.size()));
+    }
+    if(n >= cut_size){
+        end.assign(chars + n - cut_size, cut_size);
+    }
+    else{
+        end.append(chars, n);
+        if(end.size() > cut_size)
+            end.erase(0, end.size() - cut_size);
+    }
+}
+
+/**
+    Add a chunk of sequence to the read ends.
+    @param the read ends to update
+    @param pointer to the first base of the chunk
+    @param number of bases in the chunk
+    @param size of the ends to keep
+*/
+inline void appendBases(read_ends_t & record, const char * bases, size_t n, uint64_t cut_size){
+    if(n > 0 and bases[n-1] == '\r')
+        n--;
+    record.length += n;
+    appendEnds(record.start, record.end, bases, n, cut_size);
+}
+
+/**
+    Parse the next record, keeping only its ends.
+    @param the parser
+    @param (output) the ends of the read
+    @return False if there is no more record to read
+*/
+bool nextRecord(ends_parser_t & parser, read_ends_t & record){
+    // skipping empty lines
+    while(fillBuffer(parser) and (parser.buffer[parser.pos] == '\n' or parser.buffer[parser.pos] == '\r'))
+        parser.pos++;
+    if(not fillBuffer(parser))
+        return(false);
+
+    char marker = parser.buffer[parser.pos];
+    if(marker != '>' and marker != '@'){
+        throw std::runtime_error("Input is not a valid FASTA / FASTQ file");
+    }
+    parser.pos++;
+    readLine(parser, &record.id);
+    record.start.clear();
+    record.end.clear();
+    record.start_qual.clear();
+    record.end_qual.clear();
+    record.length = 0;
+
+    // sequence lines, up to the next record (fasta) or the '+' separator (fastq)
+    char stop = marker == '>' ? '>' : '+';
+    while(fillBuffer(parser) and parser.buffer[parser.pos] != stop){
+        while(fillBuffer(parser)){
+            const char * first = parser.buffer.data() + parser.pos;
+            const char * last  = parser.buffer.data() + parser.end;
+            const char * eol   = (const char *) memchr(first, '\n', last - first);
+            appendBases(record, first, (eol ? eol : last) - first, parser.cut_size);
+            parser.pos = (eol ? eol + 1 : last) - parser.buffer.data();
+            if(eol)
+                break;
+        }
+    }
+
+    if(marker == '@'){
+        if(not fillBuffer(parser)){
+            throw std::runtime_error("Truncated FASTQ record: " + record.id);
+        }
+        readLine(parser, nullptr);
+        // skipping as many quality values as there are bases, only the ends are kept
+        uint64_t remaining = record.length;
+        while(remaining > 0 and fillBuffer(parser)){
+            const char * first = parser.buffer.data() + parser.pos;
+            const char * last  = parser.buffer.data() + parser.end;
+            const char * eol   = (const char *) memchr(first, '\n', std::min(uint64_t(last - first), remaining + 1));
+            const char * stop  = eol ? eol : first + std::min(uint64_t(last - first), remaining);
+            size_t n = stop - first;
+            if(eol and n > 0 and first[n-1] == '\r')
+                n--;
+            if(parser.qualities)
+                appendEnds(record.start_qual, record.end_qual, first, std::min(uint64_t(n), remaining), parser.cut_size);
+            remaining -= std::min(uint64_t(n), remaining);
+            parser.pos = (eol ? eol + 1 : stop) - parser.buffer.data();
+        }
+        if(remaining > 0){
+            throw std::runtime_error("Truncated FASTQ record: " + record.id);
+        }
+        // end of the quality line
+        if(fillBuffer(parser) and parser.buffer[parser.pos] != '@')
+            readLine(parser, nullptr);
+    }
+    return(true);
+}
+
+
+/**
+    Copy bytes from the parser buffer.
+    @param the parser
+    @param destination, or nullptr to skip the bytes
+    @param number of bytes
+    @return False if the input ended before
+*/
+bool readBytes(ends_parser_t & parser, void * destination, size_t size){
+    char * out = (char *) destination;
+    while(size > 0){
+        if(not fillBuffer(parser))
+            return(false);
+        size_t n = std::min(size, parser.end - parser.pos);
+        if(out != nullptr){
+            memcpy(out, parser.buffer.data() + parser.pos, n);
+            out += n;
+        }
+        parser.pos += n;
+        size -= n;
+    }
+    return(true);
+}
+
+/**
+    Check if the (decompressed) input is a BAM file.
+    @param the parser, before anything has been read
+    @return True if the input starts with the BAM magic
+*/
+bool isBam(ends_parser_t & parser){
+    return(fillBuffer(parser) and parser.end - parser.pos >= 4 and memcmp(parser.buffer.data() + parser.pos, "BAM\1", 4) == 0);
+}
+
+/**
+    Read a little endian integer from a BAM stream (BAM is little endian,
+    like the hosts we run on).
+    @param the parser
+    @return the value
+*/
+template<typename TInt>
+TInt readBamInt(ends_parser_t & parser){
+    TInt value;
+    if(not readBytes(parser, &value, sizeof(TInt)))
+        throw std::runtime_error("Truncated BAM file");
+    return(value);
+}
+
+/**
+    Skip the BAM header (text header and reference list).
+    @param the parser
+*/
+void skipBamHeader(ends_parser_t & parser){
+    readBytes(parser, nullptr, 4);
+    readBytes(parser, nullptr, readBamInt<int32_t>(parser));
+    int32_t nb_ref = readBamInt<int32_t>(parser);
+    for(int32_t i = 0; i < nb_ref; i++){
+        readBytes(parser, nullptr, readBamInt<int32_t>(parser) + 4);
+    }
+}
+
+/**
+    Decode packed BAM bases (4 bits per base) to characters.
+    @param packed bases, first base in the high nibble
+    @param index of the first base to decode in the packed bases
+    @param number of bases to decode
+    @param (output) the decoded bases
+*/
+inline void decodeBamBases(const std::vector<uint8_t> & packed, uint64_t first, uint64_t nb_bases, std::string & bases){
+    static const char BAM_BASES[] = "=ACMGRSVTWYHKDBN";
+    bases.resize(nb_bases);
+    for(uint64_t i = 0; i < nb_bases; i++){
+        uint64_t pos = first + i;
+        uint8_t code = pos & 1 ? packed[pos / 2] & 15 : packed[pos / 2] >> 4;
+        bases[i] = BAM_BASES[code];
+    }
+}
+
+/**
+    Reverse complement a read end in place.
+    @param the bases
+*/
+inline void reverseComplement(std::string & bases){
+    std::reverse(bases.begin(), bases.end());
+    for(char & c: bases){
+        switch(c){
+            case 'A': c = 'T'; break;
+            case 'C': c = 'G'; break;
+            case 'G': c = 'C'; break;
+            case 'T': c = 'A'; break;
+            default : c = 'N';
+        }
+    }
+}
+
+/**
+    Parse the next primary BAM record, keeping only the ends of the read.
+    Secondary and supplementary alignments are skipped, reads aligned on
+    the reverse strand are put back in their sequencing orientation.
+    Only the packed bases of the ends are read, the middle of the read is skipped.
+    @param the parser, after skipBamHeader
+    @param (output) the ends of the read
+    @return False if there is no more record to read
+*/
+bool nextBamRecord(ends_parser_t & parser, read_ends_t & record){
+    std::vector<uint8_t> & packed = parser.packed;
+    while(true){
+        int32_t block_size;
+        if(not readBytes(parser, &block_size, 4))
+            return(false);
+        uint8_t fixed[32];
+        if(block_size < 32 or not readBytes(parser, fixed, 32))
+            throw std::runtime_error("Truncated BAM record");
+        uint8_t name_length = fixed[8];
+        uint16_t nb_cigar, flag;
+        int32_t seq_length;
+        memcpy(&nb_cigar, fixed + 12, 2);
+        memcpy(&flag, fixed + 14, 2);
+        memcpy(&seq_length, fixed + 16, 4);
+        uint64_t remaining = block_size - 32;
+
+        if(flag & 0x900){
+            readBytes(parser, nullptr, remaining);
+            continue;
+        }
+
+        record.id.resize(name_length);
+        readBytes(parser, &record.id[0], name_length);
+        record.id.resize(strnlen(record.id.data(), name_length));
+        readBytes(parser, nullptr, 4 * nb_cigar);
+        remaining -= name_length + 4 * nb_cigar;
+
+        // packed bases of the start and of the end, back to back: the
+        // skipped middle bytes are not stored, so the buffer holds at most
+        // two windows whatever the read length
+        record.length = seq_length;
+        uint64_t current_cut_size = std::min(record.length, parser.cut_size);
+        uint64_t packed_size = (record.length + 1) / 2;
+        uint64_t head = std::min(packed_size, (current_cut_size + 1) / 2);
+        uint64_t tail_start = (record.length - current_cut_size) / 2;
+        uint64_t skipped = tail_start > head ? tail_start - head : 0;
+        packed.resize(packed_size - skipped);
+        readBytes(parser, packed.data(), head);
+        readBytes(parser, nullptr, skipped);
+        readBytes(parser, packed.data() + head, packed_size - skipped - head);
+        decodeBamBases(packed, 0, current_cut_size, record.start);
+        decodeBamBases(packed, record.length - current_cut_size - 2 * skipped, current_cut_size, record.end);
+        remaining -= packed_size;
+        record.start_qual.clear();
+        record.end_qual.clear();
+        if(parser.qualities){
+            // raw Phred values, 0xFF when the qualities are missing
+            record.start_qual.resize(current_cut_size);
+            record.end_qual.resize(current_cut_size);
+            uint64_t tail_size = std::min(current_cut_size, record.length - current_cut_size);
+            readBytes(parser, &record.start_qual[0], current_cut_size);
+            readBytes(parser, nullptr, record.length - current_cut_size - tail_size);
+            readBytes(parser, &record.end_qual[0] + current_cut_size - tail_size, tail_size);
+            // the end overlaps the start in short reads
+            std::copy(record.start_qual.end() - (current_cut_size - tail_size), record.start_qual.end(), record.end_qual.begin());
+            remaining -= record.length;
+            if(current_cut_size > 0 and uint8_t(record.start_qual[0]) == 0xFF){
+                record.start_qual.clear();
+                record.end_qual.clear();
+            }
+            for(std::string * quals: {&record.start_qual, &record.end_qual}){
+                for(char & q: *quals)
+                    q += PHRED_OFFSET;
+            }
+        }
+        if(flag & 0x10){
+            std::swap(record.start, record.end);
+            reverseComplement(record.start);
+            reverseComplement(record.end);
+            std::swap(record.start_qual, record.end_qual);
+            std::reverse(record.start_qual.begin(), record.start_qual.end());
+            std::reverse(record.end_qual.begin(), record.end_qual.end());
+        }
+        // qualities and tags
+        if(not readBytes(parser, nullptr, remaining))
+            throw std::runtime_error("Truncated BAM record");
+        return(true);
+    }
+}
+
+
+/**
+    Read only memory mapping of an uncompressed input file.
+    Compressed files and non regular files (pipes...) are not mapped.
+*/
+struct mapped_file_t{
+    const char * data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+
+    mapped_file_t(std::string input_file){
+        if(not isRegularFile(input_file))
+            return;
+        int fd = open(input_file.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 or fstat(fd, &st) != 0 or not S_ISREG(st.st_mode)){
+            if(fd >= 0)
+                close(fd);
+            return;
+        }
+        if(hasCompressedMagic(fd)){
+            close(fd);
+            return;
+        }
+        size = st.st_size;
+        if(size > 0){
+            void * addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(addr == MAP_FAILED){
+                close(fd);
+                size = 0;
+                return;
+            }
+            data = (const char *) addr;
+            madvise(addr, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        mapped = true;
+    }
+    ~mapped_file_t(){
+        if(data != nullptr)
+            munmap((void *) data, size);
+    }
+};
+
+/**
+    Lightweight view of a record inside a mapped file. Nothing is copied,
+    the sequence may still contain line breaks (multi-line fasta).
+*/
+struct record_view_t{
+    const char * id;       // first character of the read name
+    size_t id_length;      // size of the read name, up to the first blank
+    const char * seq;      // first byte of the sequence
+    const char * seq_end;  // one past the last byte of the sequence
+    const char * qual;     // first byte of the qualities, nullptr for fasta
+    const char * qual_end; // one past the last byte of the qualities
+    uint64_t length;       // number of bases
+};
+
+/**
+    Find the end of the current line.
+    @param position in the line
+    @param end of the mapped region
+    @return pointer to the '\n', or to the end of the region
+*/
+inline const char * lineEnd(const char * cursor, const char * end){
+    const char * eol = (const char *) memchr(cursor, '\n', end - cursor);
+    return(eol ? eol : end);
+}
+
+/**
+    Scan the next record boundaries in place, without copying anything.
+    @param (input/output) current position in the mapped region
+    @param end of the mapped region
+    @param (output) view of the record
+    @return False if there is no more record
+*/
+bool nextView(const char * & cursor, const char * end, record_view_t & view){
+    while(cursor < end and (*cursor == '\n' or *cursor == '\r'))
+        cursor++;
+    if(cursor >= end)
+        return(false);
+
+    char marker = *cursor;
+    if(marker != '>' and marker != '@'){
+        throw std::runtime_error("Input is not a valid FASTA / FASTQ file");
+    }
+    const char * eol = lineEnd(cursor, end);
+    view.id = cursor + 1;
+    view.id_length = 0;
+    while(view.id + view.id_length < eol and not isspace(view.id[view.id_length]))
+        view.id_length++;
+    cursor = eol + (eol < end);
+
+    // sequence lines, up to the next record (fasta) or the '+' separator (fastq)
+    char stop = marker == '>' ? '>' : '+';
+    view.seq = cursor;
+    view.length = 0;
+    uint64_t nb_lines = 0;
+    while(cursor < end and *cursor != stop){
+        nb_lines++;
+        eol = lineEnd(cursor, end);
+        view.length += (eol - cursor) - (eol > cursor and eol[-1] == '\r');
+        cursor = eol + (eol < end);
+    }
+    view.seq_end = cursor;
+    view.qual = nullptr;
+    view.qual_end = nullptr;
+
+    if(marker == '@'){
+        if(cursor >= end){
+            throw std::runtime_error("Truncated FASTQ record: " + std::string(view.id, view.id_length));
+        }
+        // the '+' line must be followed by the qualities, unless the read is empty
+        eol = lineEnd(cursor, end);
+        if(eol >= end and view.length > 0){
+            throw std::runtime_error("Truncated FASTQ record: " + std::string(view.id, view.id_length));
+        }
+        cursor = eol + (eol < end);
+        view.qual = cursor;
+        // single line qualities can be skipped without scanning them
+        if(nb_lines <= 1 and view.length <= uint64_t(end - cursor) and (cursor + view.length == end or cursor[view.length] == '\n' or cursor[view.length] == '\r')){
+            cursor = std::min(lineEnd(cursor + view.length, end) + 1, end);
+        }
+        else{
+            uint64_t remaining = view.length;
+            while(remaining > 0 and cursor < end){
+                eol = lineEnd(cursor, end);
+                remaining -= std::min(remaining, uint64_t((eol - cursor) - (eol > cursor and eol[-1] == '\r')));
+                cursor = eol + (eol < end);
+            }
+            if(remaining > 0){
+                throw std::runtime_error("Truncated FASTQ record: " + std::string(view.id, view.id_length));
+            }
+        }
+        view.qual_end = cursor;
+    }
+    return(true);
+}
+
+/**
+    Copy the ends of a region of a mapped record, skipping line breaks.
+    @param first byte of the region
+    @param one past the last byte of the region
+    @param number of characters in the region, line breaks excluded
+    @param size of the ends to copy
+    @param (output) first characters
+    @param (output) last characters
+*/
+void copyEnds(const char * first, const char * last, uint64_t length, uint64_t cut_size, std::string & start, std::string & end){
+    uint64_t current_cut_size = std::min(length, cut_size);
+    start.clear();
+    for(const char * c = first; start.size() < current_cut_size; c++){
+        if(*c != '\n' and *c != '\r')
+            start.push_back(*c);
+    }
+    end.assign(current_cut_size, 'N');
+    uint64_t i = current_cut_size;
+    for(const char * c = last - 1; i > 0; c--){
+        if(*c != '\n' and *c != '\r')
+            end[--i] = *c;
+    }
+}
+
+/**
+    Copy the ends of a viewed record, skipping line breaks.
+    @param the record view
+    @param size of the ends to copy
+    @param (output) first bases of the read
+    @param (output) last bases of the read
+*/
+inline void viewEnds(record_view_t const & view, uint64_t cut_size, std::string & start, std::string & end){
+    copyEnds(view.seq, view.seq_end, view.length, cut_size, start, end);
+}
+
+/**
+    Copy the qualities of the ends of a viewed record.
+    @param the record view
+    @param size of the ends to copy
+    @param (output) qualities of the first bases, empty for fasta
+    @param (output) qualities of the last bases, empty for fasta
+*/
+inline void viewQualityEnds(record_view_t const & view, uint64_t cut_size, std::string & start, std::string & end){
+    if(view.qual == nullptr){
+        start.clear();
+        end.clear();
+        return;
+    }
+    copyEnds(view.qual, view.qual_end, view.length, cut_size, start, end);
+}
+
+
+/**
+    Fixed size reservoir of read ends, filled while streaming the input
+    (Vitter's algorithm R). Only the first and last sl bases of each read
+    are kept, so memory stays in O(sn * sl) whatever the input size.
+*/
+struct end_reservoir_t{
+    packed_sample_t starts;    // sampled read starts
+    packed_sample_t ends;      // sampled read ends, same order as starts
+    uint64_t capacity = 0;     // number of reads to keep
+    uint64_t cut_size = 0;     // size of the sampled portions
+    uint64_t seen     = 0;     // number of reads offered so far
+    std::mt19937_64 rng;
+
+    // k-mer counts of the reservoir content, kept up to date while it
+    // fills when counting is enabled (see enableCounting)
+    bool counting = false;
+    uint8_t k = 0;
+    float threshold = 0;
+    kmer_filter_t const * kmer_set = nullptr;
+    counter start_count;
+    counter end_count;
+
+    // quality filter, applied before reads are offered (see setQualityFilter)
+    double min_quality = 0;    // minimum mean quality of both ends
+    uint8_t mask_quality = 0;  // bases of lower quality are masked (N)
+
+    // length filter and stratification (see setLengthFilter)
+    uint64_t min_length = 0;   // shorter reads are not offered
+    bool stratified = false;   // one reservoir per octave of read length
+    std::vector<std::unique_ptr<end_reservoir_t> > strata;
+};
+
+/**
+    Prepare an empty reservoir.
+    @param the reservoir to initialise
+    @param Number of sequences to sample
+    @param Size of the sampled sequence, at each end: the end window holds
+           the last cut_size bases (earlier versions kept cut_size + 1)
+*/
+void initReservoir(end_reservoir_t & reservoir, uint64_t nb_sample, uint64_t cut_size){
+    initPacked(reservoir.starts, cut_size);
+    initPacked(reservoir.ends, cut_size);
+    reservoir.capacity = nb_sample;
+    reservoir.cut_size = cut_size;
+    reservoir.seen = 0;
+    reservoir.counting = false;
+    reservoir.start_count.clear();
+    reservoir.end_count.clear();
+    reservoir.strata.clear();
+    std::random_device rd;
+    reservoir.rng.seed(rd());
+}
+
+/**
+    Count the k-mers of the reservoir while it fills, so exact counting
+    overlaps with reading the input. Must be called on an empty reservoir.
+    @param the reservoir
+    @param k, size of the kmers
+    @param threshold of the low complexity filter
+    @param set of forbidden kmers
+*/
+void enableCounting(end_reservoir_t & reservoir, uint8_t k, float threshold, kmer_filter_t const & kmer_set){
+    reservoir.counting = true;
+    reservoir.k = k;
+    reservoir.threshold = threshold;
+    reservoir.kmer_set = &kmer_set;
+    reservoir.start_count.reserve(maxDistinctKmers(reservoir.capacity * reservoir.cut_size, k));
+    reservoir.end_count.reserve(maxDistinctKmers(reservoir.capacity * reservoir.cut_size, k));
+}
+
+/**
+    Filter the reads offered to the reservoir on the qualities of their
+    ends (FASTQ and BAM inputs, reads without qualities always pass).
+    Low quality ends bring many k-mers found in no other read, that
+    inflate the count table and the approximate search.
+    @param the reservoir
+    @param minimum mean quality of both ends, 0 to keep all reads
+    @param bases of lower quality are masked (N) in the kept ends, 0 to keep them
+*/
+void setQualityFilter(end_reservoir_t & reservoir, double min_quality, uint8_t mask_quality){
+    reservoir.min_quality = min_quality;
+    reservoir.mask_quality = mask_quality;
+}
+
+/**
+    Tell if the reservoir needs the qualities of the reads.
+    @param the reservoir
+    @return True if a quality filter is set
+*/
+inline bool usesQualities(end_reservoir_t const & reservoir){
+    return(reservoir.min_quality > 0 or reservoir.mask_quality > 0);
+}
+
+/**
+    Mean quality of a read end. Error probabilities are averaged, rather
+    than Phred scores, so a few bad bases weigh as much as they should.
+    @param the qualities (Phred + 33)
+    @return the mean quality, in Phred scale
+*/
+double meanQuality(std::string const & quals){
+    static const std::vector<double> error_rates = []{
+        std::vector<double> rates(256);
+        for(int q = 0; q < 256; q++)
+            rates[q] = std::pow(10.0, -std::max(q - PHRED_OFFSET, 0) / 10.0);
+        return(rates);
+    }();
+    if(quals.empty())
+        return(0);
+    double error = 0;
+    for(char q: quals)
+        error += error_rates[uint8_t(q)];
+    return(-10 * std::log10(error / quals.size()));
+}
+
+/**
+    Check the quality of the ends of a read against the reservoir filter.
+    @param the reservoir
+    @param qualities of the first bases, empty if unknown
+    @param qualities of the last bases, empty if unknown
+    @return False if the read must not be offered to the reservoir
+*/
+inline bool passQuality(end_reservoir_t const & reservoir, std::string const & start_qual, std::string const & end_qual){
+    if(reservoir.min_quality <= 0 or start_qual.empty())
+        return(true);
+    return(meanQuality(start_qual) >= reservoir.min_quality and meanQuality(end_qual) >= reservoir.min_quality);
+}
+
+/**
+    Mask the bases of a read end whose quality is below the reservoir
+    mask threshold, no k-mer is then counted across them.
+    @param the reservoir
+    @param the bases to mask
+    @param their qualities, empty if unknown
+*/
+inline void maskQuality(end_reservoir_t const & reservoir, std::string & bases, std::string const & quals){
+    if(reservoir.mask_quality == 0 or quals.size() != bases.size())
+        return;
+    for(size_t i = 0; i < bases.size(); i++){
+        if(uint8_t(quals[i]) < PHRED_OFFSET + reservoir.mask_quality)
+            bases[i] = 'N';
+    }
+}
+
+/**
+    Filter the reads offered to the reservoir on their length, and
+    optionally stratify the sample on read length. The ends of reads
+    shorter than twice the sampled size overlap, their end window then
+    holds the start adapter.
+    When stratified, reads are binned by octave of length (1-2 kb, 2-4 kb...),
+    each bin filling its own reservoir. Bins get an equal share of the final
+    sample (see finishStrata), so a few long reads are not drowned in fragments.
+    @param the reservoir
+    @param minimum read length, 0 to keep all reads
+    @param True to stratify the sample on read length
+*/
+void setLengthFilter(end_reservoir_t & reservoir, uint64_t min_length, bool stratified){
+    reservoir.min_length = min_length;
+    reservoir.stratified = stratified;
+}
+
+/**
+    Check the length of a read against the reservoir filter.
+    @param the reservoir
+    @param the read length
+    @return False if the read must not be offered to the reservoir
+*/
+inline bool passLength(end_reservoir_t const & reservoir, uint64_t read_length){
+    return(read_length >= reservoir.min_length);
+}
+
+/**
+    Reservoir a read must be offered to: the reservoir itself, or the
+    stratum of its length when the reservoir is stratified.
+    @param the reservoir
+    @param the read length
+    @return the reservoir to use with reservoirSlot and reservoirStore
+*/
+end_reservoir_t & reservoirFor(end_reservoir_t & reservoir, uint64_t read_length){
+    if(not reservoir.stratified)
+        return(reservoir);
+    size_t octave = 0;
+    while(read_length >> (octave + 1))
+        octave++;
+    if(reservoir.strata.size() <= octave)
+        reservoir.strata.resize(octave + 1);
+    if(not reservoir.strata[octave]){
+        reservoir.strata[octave].reset(new end_reservoir_t());
+        initReservoir(*reservoir.strata[octave], reservoir.capacity, reservoir.cut_size);
+    }
+    return(*reservoir.strata[octave]);
+}
+
+/**
+    Offer a new read to the reservoir, and tell if it should be kept.
+    Decision is taken before any copy, so rejected reads cost nothing.
+    @param the reservoir
+    @param (output) the slot in which the read must be stored
+    @return True if the read is kept
+*/
+inline bool reservoirSlot(end_reservoir_t & reservoir, uint64_t & slot){
+    slot = reservoir.seen;
+    if(reservoir.seen >= reservoir.capacity){
+        std::uniform_int_distribution<uint64_t> dist(0, reservoir.seen);
+        slot = dist(reservoir.rng);
+    }
+    reservoir.seen++;
+    return(slot < reservoir.capacity);
+}
+
+/**
+    Store the ends of a read in a reservoir slot (see reservoirSlot).
+    @param the reservoir
+    @param the slot to fill
+    @param the start of the read, at most cut_size long (chars, Dna5 or a packed view)
+    @param the end of the read, at most cut_size long
+*/
+template<typename TStart, typename TEnd>
+void reservoirStore(end_reservoir_t & reservoir, uint64_t slot, TStart const & start, TEnd const & end){
+    if(reservoir.counting and slot < length(reservoir.starts)){
+        updateKmerCount(reservoir.start_count, packedView(reservoir.starts, slot), reservoir.k, reservoir.threshold, *reservoir.kmer_set, true);
+        updateKmerCount(reservoir.end_count, packedView(reservoir.ends, slot), reservoir.k, reservoir.threshold, *reservoir.kmer_set, true);
+    }
+    packedStore(reservoir.starts, slot, start);
+    packedStore(reservoir.ends, slot, end);
+    // counted once packed, whatever the type of the input
+    if(reservoir.counting){
+        updateKmerCount(reservoir.start_count, packedView(reservoir.starts, slot), reservoir.k, reservoir.threshold, *reservoir.kmer_set);
+        updateKmerCount(reservoir.end_count, packedView(reservoir.ends, slot), reservoir.k, reservoir.threshold, *reservoir.kmer_set);
+    }
+}
+
+/**
+    Merge a reservoir into another one. Both hold uniform samples of their
+    own stream, the result is a uniform sample of the concatenated streams:
+    the number of reads taken from each side follows the hypergeometric
+    law, drawn one read at a time.
+    @param the reservoir receiving the merged sample
+    @param the reservoir to merge, left empty
+*/
+void mergeReservoir(end_reservoir_t & reservoir, end_reservoir_t & other){
+    // stratified reservoirs are merged stratum by stratum
+    for(size_t i = 0; i < other.strata.size(); i++){
+        if(other.strata[i])
+            mergeReservoir(reservoirFor(reservoir, uint64_t(1) << i), *other.strata[i]);
+    }
+    other.strata.clear();
+    uint64_t remaining[2] = {reservoir.seen, other.seen};
+    uint64_t nb_sample = std::min(reservoir.capacity, remaining[0] + remaining[1]);
+    uint64_t taken[2] = {0, 0};
+    for(uint64_t i = 0; i < nb_sample; i++){
+        std::uniform_int_distribution<uint64_t> dist(0, remaining[0] + remaining[1] - 1);
+        int side = dist(reservoir.rng) < remaining[0] ? 0 : 1;
+        remaining[side]--;
+        taken[side]++;
+    }
+
+    // reservoir slots are not exchangeable, random subsets are needed on both sides
+    end_reservoir_t * sides[2] = {&reservoir, &other};
+    packed_sample_t starts;
+    packed_sample_t ends;
+    initPacked(starts, reservoir.cut_size);
+    initPacked(ends, reservoir.cut_size);
+    for(int side = 0; side < 2; side++){
+        std::vector<uint64_t> vec(length(sides[side]->starts));
+        std::iota(std::begin(vec), std::end(vec), 0);
+        std::shuffle(vec.begin(), vec.end(), reservoir.rng);
+        for(uint64_t i = 0; i < taken[side]; i++){
+            packedStore(starts, length(starts), packedView(sides[side]->starts, vec[i]));
+            packedStore(ends, length(ends), packedView(sides[side]->ends, vec[i]));
+        }
+    }
+    reservoir.starts = std::move(starts);
+    reservoir.ends = std::move(ends);
+    reservoir.seen += other.seen;
+    if(reservoir.counting){
+        reservoir.start_count.clear();
+        reservoir.end_count.clear();
+        for(uint64_t i = 0; i < length(reservoir.starts); i++){
+            updateKmerCount(reservoir.start_count, packedView(reservoir.starts, i), reservoir.k, reservoir.threshold, *reservoir.kmer_set);
+            updateKmerCount(reservoir.end_count, packedView(reservoir.ends, i), reservoir.k, reservoir.threshold, *reservoir.kmer_set);
+        }
+    }
+    initPacked(other.starts, other.cut_size);
+    initPacked(other.ends, other.cut_size);
+    other.seen = 0;
+}
+
+/**
+    Gather the strata of a stratified reservoir into the final sample.
+    Strata get equal shares of the reservoir capacity, the share of strata
+    holding fewer reads being split between the others.
+    @param the stratified reservoir, holding the final sample afterwards
+*/
+void finishStrata(end_reservoir_t & reservoir){
+    std::vector<end_reservoir_t *> strata;
+    for(std::unique_ptr<end_reservoir_t> & stratum: reservoir.strata){
+        if(stratum and length(stratum->starts) > 0)
+            strata.push_back(stratum.get());
+    }
+    if(strata.empty())
+        return;
+    // smallest strata first, so their unused share goes to the next ones
+    std::sort(strata.begin(), strata.end(), [](end_reservoir_t * a, end_reservoir_t * b){
+        return(length(a->starts) < length(b->starts));
+    });
+    uint64_t remaining = reservoir.capacity - std::min(reservoir.capacity, uint64_t(length(reservoir.starts)));
+    uint64_t slot = length(reservoir.starts);
+    for(size_t i = 0; i < strata.size(); i++){
+        end_reservoir_t & stratum = *strata[i];
+        uint64_t taken = std::min(uint64_t(length(stratum.starts)), remaining / (strata.size() - i));
+        remaining -= taken;
+        // reservoir slots are not exchangeable, a random subset is needed
+        std::vector<uint64_t> vec(length(stratum.starts));
+        std::iota(std::begin(vec), std::end(vec), 0);
+        std::shuffle(vec.begin(), vec.end(), reservoir.rng);
+        for(uint64_t j = 0; j < taken; j++, slot++){
+            reservoirStore(reservoir, slot, packedView(stratum.starts, vec[j]), packedView(stratum.ends, vec[j]));
+        }
+        reservoir.seen += stratum.seen;
+    }
+    reservoir.strata.clear();
+}
+
+
+/**
+    Pick distinct random indices, with a partial Fisher-Yates shuffle.
+    @param number of elements to pick from
+    @param number of elements to pick
+    @param random generator
+    @return the picked indices, sorted
+*/
+std::vector<uint64_t> sampleIndices(uint64_t set_size, uint64_t nb_sample, std::mt19937_64 & rng){
+    nb_sample = std::min(set_size, nb_sample);
+    std::vector<uint64_t> vec(set_size);
+    std::iota(std::begin(vec), std::end(vec), 0);
+    for(uint64_t i = 0; i < nb_sample; i++){
+        std::uniform_int_distribution<uint64_t> dist(i, set_size - 1);
+        std::swap(vec[i], vec[dist(rng)]);
+    }
+    vec.resize(nb_sample);
+    std::sort(vec.begin(), vec.end());
+    return(vec);
+}
+
+/**
+    Sample the sequences set, and cut both ends of the sampled reads in a
+    single pass: start and end samples come from the same reads.
+    @param Set of sequences to sample (SeqAn StringSet of packed Dna5String)
+    @param the reservoir receiving the sample, see initReservoir
+    @param verbosity level
+*/
+void sampleSequences(read_set_type & sequence_set, end_reservoir_t & reservoir, uint8_t v){
+    // reads passing the length filter
+    std::vector<uint64_t> eligible;
+    for(uint64_t i = 0; i < length(sequence_set); i++){
+        if(passLength(reservoir, length(sequence_set[i])))
+            eligible.push_back(i);
+    }
+    uint64_t sequence_set_size = eligible.size();
+    std::vector<uint64_t> vec = sampleIndices(sequence_set_size, reservoir.capacity, reservoir.rng);
+
+    for(uint64_t i = 0; i < vec.size(); i++){
+        auto const & seq = sequence_set[eligible[vec[i]]];
+        uint64_t seq_len = length(seq);
+        // asjusting cut size to read length, if it is too short.
+        uint64_t current_cut_size = std::min(seq_len, reservoir.cut_size);
+        if(current_cut_size < reservoir.cut_size and v >= 2){
+            print("/!\\Cut size is longer that current read!");
+        }
+        reservoirStore(reservoir, i, prefix(seq, current_cut_size), suffix(seq, seq_len - current_cut_size));
+    }
+    reservoir.seen = sequence_set_size;
+    if(v>0)
+        print("Sampled " + std::to_string(length(reservoir.starts)) + " sequences",1);
+}
+
+/**
+    Sample a memory mapped input. Records are scanned in place by a
+    separate thread, and only the ends of the reads kept by the reservoir
+    are copied.
+    @param the mapped input file
+    @param the reservoir to fill, see initReservoir
+*/
+void mappedSample(mapped_file_t const & input, end_reservoir_t & reservoir){
+    const char * cursor = input.data;
+    const char * end = input.data + input.size;
+    bool qualities = usesQualities(reservoir);
+    std::string start_bases;
+    std::string end_bases;
+    std::string start_qual;
+    std::string end_qual;
+    runPipeline<record_view_t>(
+        [&cursor, end](record_view_t & view){
+            return(nextView(cursor, end, view));
+        },
+        [&](record_view_t & view){
+            if(not passLength(reservoir, view.length))
+                return;
+            if(qualities){
+                viewQualityEnds(view, reservoir.cut_size, start_qual, end_qual);
+                if(not passQuality(reservoir, start_qual, end_qual))
+                    return;
+            }
+            end_reservoir_t & target = reservoirFor(reservoir, view.length);
+            uint64_t slot;
+            if(reservoirSlot(target, slot)){
+                viewEnds(view, reservoir.cut_size, start_bases, end_bases);
+                maskQuality(reservoir, start_bases, start_qual);
+                maskQuality(reservoir, end_bases, end_qual);
+                reservoirStore(target, slot, start_bases, end_bases);
+            }
+        });
+}
+
+/**
+    Sample a byte source: a parser thread extracts the ends of the reads,
+    while the calling thread fills the reservoir (and counts k-mers).
+    @param the byte source
+    @param the reservoir to fill, see initReservoir
+*/
+void sourceSample(byte_source_t * source, end_reservoir_t & reservoir){
+    ends_parser_t parser(source, reservoir.cut_size);
+    parser.qualities = usesQualities(reservoir);
+    bool bam = isBam(parser);
+    if(bam)
+        skipBamHeader(parser);
+    runPipeline<read_ends_t>(
+        // short and low quality reads are dropped by the parser thread
+        [&parser, &reservoir, bam](read_ends_t & record){
+            while(bam ? nextBamRecord(parser, record) : nextRecord(parser, record)){
+                if(passLength(reservoir, record.length) and passQuality(reservoir, record.start_qual, record.end_qual))
+                    return(true);
+            }
+            return(false);
+        },
+        [&reservoir](read_ends_t & record){
+            end_reservoir_t & target = reservoirFor(reservoir, record.length);
+            uint64_t slot;
+            if(reservoirSlot(target, slot)){
+                maskQuality(reservoir, record.start, record.start_qual);
+                maskQuality(reservoir, record.end, record.end_qual);
+                reservoirStore(target, slot, record.start, record.end);
+            }
+        });
+}
+
+/**
+    Read an input file one record at a time, keeping only a reservoir
+    of read ends instead of the whole file. Uncompressed files are memory
+    mapped, other inputs (gzip, BAM) go through the ends-only parser: in both cases
+    only the ends of each read are copied, and only the kept ones are
+    converted to Dna5String. Reading, decoding and sampling (and counting,
+    see enableCounting) run in separate threads, linked by bounded queues.
+    @param path to the input file (fasta / fastq, possibly gzipped)
+    @param the reservoir to fill, see initReservoir
+    @param number of threads available for decompression
+*/
+void streamFile(std::string input_file, end_reservoir_t & reservoir, uint64_t nb_thread){
+    mapped_file_t input(input_file);
+    if(input.mapped){
+        mappedSample(input, reservoir);
+    }
+    else{
+        std::unique_ptr<byte_source_t> source = openByteSource(input_file, nb_thread);
+        sourceSample(source.get(), reservoir);
+    }
+}
+
+/**
+    Stream an input file into a reservoir, see streamFile.
+    @param path to the input file (fasta / fastq, possibly gzipped)
+    @param the reservoir to fill, see initReservoir
+    @param number of threads available for decompression
+    @param verbosity level
+*/
+void streamSample(std::string input_file, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+    streamFile(input_file, reservoir, nb_thread);
+    finishStrata(reservoir);
+    if(v>0)
+        print("Streamed " + std::to_string(reservoir.seen) + " sequences, kept " + std::to_string(length(reservoir.starts)),1);
+}
+
+/**
+    Check the extension of a file name.
+    @param the file name
+    @param the extension, dot included
+    @return True if the file name ends with the extension
+*/
+inline bool hasExtension(std::string const & file_name, std::string const & extension){
+    return(file_name.size() > extension.size() and file_name.compare(file_name.size() - extension.size(), extension.size(), extension) == 0);
+}
+
+/**
+    Check if a file name looks like a FASTA / FASTQ file (possibly gzip or
+    Zstandard compressed) or a BAM file.
+    @param the file name
+    @return True if the extension is known
+*/
+bool isSequenceFile(std::string file_name){
+    if(hasExtension(file_name, ".gz"))
+        file_name.resize(file_name.size() - 3);
+    else if(hasExtension(file_name, ".zst"))
+        file_name.resize(file_name.size() - 4);
+    for(std::string extension: {".fastq", ".fq", ".fasta", ".fa", ".fna", ".bam"}){
+        if(hasExtension(file_name, extension))
+            return(true);
+    }
+    return(false);
+}
+
+/**
+    Recursively list the sequence files of a directory (run directories
+    may have one sub-directory per barcode). MinKNOW run roots hold the
+    same reads in several formats and keep failed reads apart: "*_fail"
+    sub-directories are skipped, and when "*_pass" sub-directories exist
+    only one is searched, fastq_pass first, then bam_pass.
+    @param path to the directory
+    @param (output) the files found
+*/
+void listDirectory(std::string directory, std::vector<std::string> & files){
+    DIR * dir = opendir(directory.c_str());
+    if(dir == nullptr)
+        return;
+    std::vector<std::string> sub_directories;
+    std::vector<std::string> pass_directories;
+    for(struct dirent * entry = readdir(dir); entry != nullptr; entry = readdir(dir)){
+        std::string name = entry->d_name;
+        if(name == "." or name == "..")
+            continue;
+        std::string path = directory + "/" + name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode)){
+            if(hasExtension(name, "_pass"))
+                pass_directories.push_back(name);
+            else if(not hasExtension(name, "_fail"))
+                sub_directories.push_back(name);
+        }
+        else if(S_ISREG(st.st_mode) and isSequenceFile(name))
+            files.push_back(path);
+    }
+    closedir(dir);
+    if(not pass_directories.empty()){
+        std::sort(pass_directories.begin(), pass_directories.end());
+        std::string picked = pass_directories[0];
+        for(std::string preferred: {"bam_pass", "fastq_pass"}){
+            if(std::find(pass_directories.begin(), pass_directories.end(), preferred) != pass_directories.end())
+                picked = preferred;
+        }
+        sub_directories.assign(1, picked);
+    }
+    for(std::string const & name: sub_directories)
+        listDirectory(directory + "/" + name, files);
+}
+
+/**
+    Expand the input argument into a list of files. The input can be a
+    single file, the standard input ("-"), a directory (searched
+    recursively) or a glob pattern.
+    @param the input argument
+    @return the input files, sorted
+*/
+std::vector<std::string> listInputFiles(std::string input){
+    std::vector<std::string> files;
+    struct stat st;
+    if(input == STDIN_NAME){
+        files.push_back(input);
+    }
+    else if(stat(input.c_str(), &st) == 0){
+        if(S_ISDIR(st.st_mode))
+            listDirectory(input, files);
+        else
+            files.push_back(input);
+    }
+    else if(input.find_first_of("*?[") != std::string::npos){
+        glob_t matches;
+        if(glob(input.c_str(), 0, nullptr, &matches) == 0){
+            for(size_t i = 0; i < matches.gl_pathc; i++)
+                files.push_back(matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+    }
+    std::sort(files.begin(), files.end());
+    return(files);
+}
+
+/**
+    Sample a set of input files (a run directory for example) with a pool
+    of parallel readers. Each reader streams whole files into its own
+    reservoir, and the reservoirs are merged at the end.
+    @param the input files
+    @param the reservoir to fill, see initReservoir
+    @param number of parallel readers
+    @param verbosity level
+*/
+void directorySample(std::vector<std::string> const & input_files, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+    uint64_t nb_reader = std::max(uint64_t(1), std::min(nb_thread, uint64_t(input_files.size())));
+    std::vector<end_reservoir_t> readers(nb_reader);
+    for(end_reservoir_t & reader: readers){
+        initReservoir(reader, reservoir.capacity, reservoir.cut_size);
+        setQualityFilter(reader, reservoir.min_quality, reservoir.mask_quality);
+        setLengthFilter(reader, reservoir.min_length, reservoir.stratified);
+    }
+    #pragma omp parallel for num_threads(nb_reader) schedule(dynamic)
+    for(int64_t i = 0; i < int64_t(input_files.size()); i++){
+        // exceptions must not leave the parallel region, a bad file
+        // (still being written, for example) is skipped
+        try{
+            streamFile(input_files[i], readers[omp_get_thread_num()], 1);
+        }
+        catch(std::runtime_error & e){
+            #pragma omp critical
+            std::cerr << "/!\\ WARNING: " << input_files[i] << " skipped: " << e.what() << std::endl;
+        }
+    }
+    for(end_reservoir_t & reader: readers){
+        mergeReservoir(reservoir, reader);
+    }
+    finishStrata(reservoir);
+    if(v>0)
+        print("Streamed " + std::to_string(reservoir.seen) + " sequences from " + std::to_string(input_files.size()) + " files, kept " + std::to_string(length(reservoir.starts)),1);
+}
+
+
+/**
+    Find the first record starting at or after a position of a mapped file.
+    Fastq headers are told apart from quality lines starting with '@' by
+    checking that the separator line comes two lines later, and that
+    sequence and quality have the same size.
+    @param the position to start from
+    @param start of the mapped region
+    @param end of the mapped region
+    @param record marker, '>' for fasta, '@' for fastq
+    @return the start of the record, or end if there is none
+*/
+const char * resyncRecord(const char * cursor, const char * begin, const char * end, char marker){
+    if(cursor > begin and cursor[-1] != '\n')
+        cursor = std::min(lineEnd(cursor, end) + 1, end);
+    while(cursor < end){
+        if(*cursor == marker){
+            if(marker == '>')
+                return(cursor);
+            const char * seq = std::min(lineEnd(cursor, end) + 1, end);
+            const char * sep = std::min(lineEnd(seq, end) + 1, end);
+            if(sep < end and *sep == '+'){
+                const char * qual = std::min(lineEnd(sep, end) + 1, end);
+                if(lineEnd(seq, end) - seq == lineEnd(qual, end) - qual)
+                    return(cursor);
+            }
+        }
+        cursor = std::min(lineEnd(cursor, end) + 1, end);
+    }
+    return(end);
+}
+
+/**
+    Draw one random offset per stratum of an input. Strata cover the whole
+    input, the last one ending at its size.
+    @param size of the input
+    @param number of strata, at most the size of the input
+    @param random generator
+    @return the offsets, in increasing order
+*/
+std::vector<uint64_t> strataOffsets(uint64_t size, uint64_t nb_sample, std::mt19937_64 & rng){
+    if(size < nb_sample){
+        throw std::runtime_error("More strata than bytes in the input");
+    }
+    std::vector<uint64_t> offsets(nb_sample);
+    for(uint64_t i = 0; i < nb_sample; i++){
+        uint64_t first = i * size / nb_sample;
+        uint64_t last = (i + 1) * size / nb_sample;
+        std::uniform_int_distribution<uint64_t> dist(first, last - 1);
+        offsets[i] = dist(rng);
+    }
+    return(offsets);
+}
+
+/**
+    Copy the ends of a record picked at a random offset, applying the
+    length and quality filters of the reservoir.
+    @param the record view
+    @param the reservoir
+    @param (output) first bases of the read
+    @param (output) last bases of the read
+    @return False if the read does not pass the filters
+*/
+bool viewSample(record_view_t const & view, end_reservoir_t const & reservoir, std::string & start, std::string & end){
+    if(not passLength(reservoir, view.length))
+        return(false);
+    std::string start_qual;
+    std::string end_qual;
+    if(usesQualities(reservoir)){
+        viewQualityEnds(view, reservoir.cut_size, start_qual, end_qual);
+        if(not passQuality(reservoir, start_qual, end_qual))
+            return(false);
+    }
+    viewEnds(view, reservoir.cut_size, start, end);
+    maskQuality(reservoir, start, start_qual);
+    maskQuality(reservoir, end, end_qual);
+    return(true);
+}
+
+/**
+    Store the reads sampled at random offsets in the reservoir.
+    Neighbouring offsets may land in the same long read, it is kept once.
+    The input is not read as a whole, so the number of reads it holds (seen)
+    is estimated from the records reached: the file size over their mean
+    size, times the fraction of them passing the filters.
+    @param the reservoir
+    @param position of the record kept for each offset, NO_RECORD if none
+    @param size in bytes of the record reached from each offset, 0 if none
+    @param size of the sampled input, in bytes
+    @param read starts
+    @param read ends
+    @param verbosity level
+*/
+void storeOffsetSample(end_reservoir_t & reservoir, std::vector<uint64_t> const & records, std::vector<uint64_t> const & record_sizes,
+                       uint64_t input_size, std::vector<std::string> const & starts, std::vector<std::string> const & ends, uint8_t v){
+    uint64_t slot = 0;
+    uint64_t nb_kept = 0;
+    double reached_bytes = 0;
+    for(uint64_t i = 0; i < records.size(); i++){
+        reached_bytes += record_sizes[i];
+        if(records[i] == NO_RECORD)
+            continue;
+        nb_kept++;
+        if(i > 0 and records[i] == records[i-1])
+            continue;
+        reservoirStore(reservoir, slot, starts[i], ends[i]);
+        slot++;
+    }
+    // (size / mean record size) * (kept / reached)
+    double estimate = reached_bytes > 0 ? double(input_size) * nb_kept / reached_bytes : 0;
+    reservoir.seen = std::max(slot, uint64_t(std::llround(estimate)));
+    if(v>0)
+        print("Sampled " + std::to_string(slot) + " sequences at random offsets, about " + std::to_string(reservoir.seen) + " in the input",1);
+}
+
+#if ADAPTFINDER_HAS_ZSTD
+/**
+    Sample a Zstandard input made of several frames at random offsets of
+    its decompressed content, see offsetSample. Only the frames holding
+    sampled records are decompressed, a record spanning several frames
+    is completed with the following ones.
+    @param path to the input file
+    @param the frames, see listZstdFrames
+    @param the reservoir to fill, see initReservoir
+    @param number of parallel readers
+    @param verbosity level
+*/
+void zstdOffsetSample(std::string input_file, std::vector<zstd_frame_t> const & frames, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+    uint64_t size = frames.back().decompressed_offset + frames.back().decompressed_size;
+    uint64_t nb_sample = reservoir.capacity;
+    if(size == 0 or size / std::max(nb_sample, uint64_t(1)) == 0){
+        if(v>0)
+            print("Input can not be sampled by offset, streaming it instead",1);
+        streamSample(input_file, reservoir, nb_thread, v);
+        return;
+    }
+    int fd = open(input_file.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "/!\\ COULD NOT OPEN INPUT FILE " << input_file << ", must quit\n";
+        exit(1);
+    }
+    std::vector<uint64_t> offsets = strataOffsets(size, nb_sample, reservoir.rng);
+    std::vector<uint64_t> records(nb_sample, NO_RECORD);
+    std::vector<uint64_t> record_sizes(nb_sample, 0);
+    std::vector<std::string> starts(nb_sample);
+    std::vector<std::string> ends(nb_sample);
+    char marker = 0;
+    bool failed = false;
+    #pragma omp parallel num_threads(nb_thread) reduction(||:failed)
+    {
+        std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx *)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        // decompressed frames [first, last), after a one character sentinel
+        std::vector<char> window;
+        size_t first = frames.size();
+        size_t last = frames.size();
+        auto extend = [&]{
+            size_t start = window.size();
+            window.resize(start + frames[last].decompressed_size);
+            failed = failed or not decodeZstdFrame(fd, frames[last], dctx.get(), window.data() + start);
+            last++;
+        };
+        #pragma omp single
+        {
+            // the record marker is the first decompressed character
+            window.assign(1, '\n');
+            first = 0;
+            last = 0;
+            while(window.size() == 1 and last < frames.size() and not failed)
+                extend();
+            marker = window.size() > 1 ? window[1] : 0;
+        }
+        #pragma omp for schedule(static)
+        for(int64_t i = 0; i < int64_t(nb_sample); i++){
+            if(failed or (marker != '>' and marker != '@'))
+                continue;
+            size_t frame = std::upper_bound(frames.begin(), frames.end(), offsets[i], [](uint64_t offset, zstd_frame_t const & f){
+                return(offset < f.decompressed_offset);
+            }) - frames.begin() - 1;
+            if(frame != first){
+                // a frame may start within a line, which the sentinel tells to resyncRecord
+                window.assign(1, frame == 0 ? '\n' : '\0');
+                first = frame;
+                last = frame;
+                extend();
+            }
+            while(not failed){
+                const char * begin = window.data();
+                const char * end = begin + window.size();
+                const char * cursor = resyncRecord(begin + 1 + offsets[i] - frames[first].decompressed_offset, begin, end, marker);
+                const char * record = cursor;
+                record_view_t view;
+                bool complete = false;
+                try{
+                    complete = cursor < end and nextView(cursor, end, view) and (cursor < end or last == frames.size());
+                }
+                catch(std::runtime_error & e){
+                    // truncated at the end of the window
+                }
+                if(complete){
+                    record_sizes[i] = cursor - record;
+                    if(viewSample(view, reservoir, starts[i], ends[i]))
+                        records[i] = frames[first].decompressed_offset + (record - begin - 1);
+                    break;
+                }
+                if(last == frames.size())
+                    break;
+                extend();
+            }
+        }
+    }
+    close(fd);
+    if(failed)
+        throw std::runtime_error("Corrupted Zstandard frame");
+    if(marker != '>' and marker != '@')
+        throw std::runtime_error("Input is not a valid FASTA / FASTQ file");
+    storeOffsetSample(reservoir, records, record_sizes, size, starts, ends, v);
+}
+#endif
+
+/**
+    Sample an uncompressed input at random byte offsets, one per stratum of
+    the file, so the sample spreads over the whole run without reading it.
+    Each offset is resynchronised to the next record start. Reads are picked
+    with a probability proportional to their size on disk, this favours
+    long reads. Zstandard inputs made of several frames are sampled through
+    their frames, other inputs that cannot be mapped are streamed instead.
+    @param path to the input file
+    @param the reservoir to fill, see initReservoir
+    @param number of parallel readers
+    @param verbosity level
+*/
+void offsetSample(std::string input_file, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+#if ADAPTFINDER_HAS_ZSTD
+    std::vector<zstd_frame_t> frames = listZstdFrames(input_file);
+    if(not frames.empty()){
+        zstdOffsetSample(input_file, frames, reservoir, nb_thread, v);
+        return;
+    }
+#endif
+    mapped_file_t input(input_file);
+    uint64_t nb_sample = reservoir.capacity;
+    if(not input.mapped or input.size == 0 or input.size / std::max(nb_sample, uint64_t(1)) == 0){
+        if(v>0)
+            print("Input can not be sampled by offset, streaming it instead",1);
+        streamSample(input_file, reservoir, nb_thread, v);
+        return;
+    }
+    madvise((void *) input.data, input.size, MADV_RANDOM);
+    const char * begin = input.data;
+    const char * end = input.data + input.size;
+    char marker = *begin;
+    if(marker != '>' and marker != '@'){
+        throw std::runtime_error("Input is not a valid FASTA / FASTQ file");
+    }
+
+    std::vector<uint64_t> offsets = strataOffsets(input.size, nb_sample, reservoir.rng);
+    std::vector<uint64_t> records(nb_sample, NO_RECORD);
+    std::vector<uint64_t> record_sizes(nb_sample, 0);
+    std::vector<std::string> starts(nb_sample);
+    std::vector<std::string> ends(nb_sample);
+    #pragma omp parallel for num_threads(nb_thread) schedule(dynamic)
+    for(int64_t i = 0; i < int64_t(nb_sample); i++){
+        const char * cursor = resyncRecord(begin + offsets[i], begin, end, marker);
+        const char * record = cursor;
+        record_view_t view;
+        try{
+            if(nextView(cursor, end, view)){
+                record_sizes[i] = cursor - record;
+                if(viewSample(view, reservoir, starts[i], ends[i]))
+                    records[i] = record - begin;
+            }
+        }
+        catch(std::runtime_error & e){
+            // truncated or malformed record, this stratum is skipped
+        }
+    }
+    storeOffsetSample(reservoir, records, record_sizes, input.size, starts, ends, v);
+}
+
+
+/**
+    Entry of a samtools-style FASTA / FASTQ index (.fai).
+*/
+struct fai_entry_t{
+    uint64_t length;      // number of bases
+    uint64_t offset;      // byte offset of the first base
+    uint64_t line_bases;  // number of bases per line
+    uint64_t line_width;  // number of bytes per line, end of line included
+};
+
+/**
+    Look for a samtools-style index next to an uncompressed input file.
+    @param path to the input file
+    @return path to the index, empty if there is none
+*/
+std::string findIndex(std::string input_file){
+    if(not isRegularFile(input_file))
+        return("");
+    int fd = open(input_file.c_str(), O_RDONLY);
+    if(fd < 0)
+        return("");
+    bool compressed = hasCompressedMagic(fd);
+    close(fd);
+    if(compressed)
+        return("");
+    for(std::string extension: {".fai", ".fqi"}){
+        struct stat st;
+        if(stat((input_file + extension).c_str(), &st) == 0 and S_ISREG(st.st_mode))
+            return(input_file + extension);
+    }
+    return("");
+}
+
+/**
+    Parse a samtools-style index (FASTA or FASTQ flavour).
+    @param path to the index file
+    @param (output) the record names, or nullptr to drop them
+    @return one entry per record, in file order
+*/
+std::vector<fai_entry_t> parseIndex(std::string index_file, std::vector<std::string> * names = nullptr){
+    std::vector<fai_entry_t> entries;
+    std::ifstream index_stream(index_file);
+    if(not index_stream.is_open()){
+        std::cout << "/!\\ COULD NOT OPEN INDEX FILE " << index_file << ", must quit\n";
+        exit(1);
+    }
+    for(std::string line; getline(index_stream, line);){
+        std::istringstream fields(line);
+        std::string name;
+        fai_entry_t entry;
+        if(not (fields >> name >> entry.length >> entry.offset >> entry.line_bases >> entry.line_width)
+           or entry.line_bases == 0 or entry.line_width < entry.line_bases){
+            throw std::runtime_error("Malformed index line: " + line);
+        }
+        entries.push_back(entry);
+        if(names != nullptr)
+            names->push_back(name);
+    }
+    return(entries);
+}
+
+/**
+    Check an index against its input file: records must follow each other
+    and fit in the file. A stale index (left over from another version of
+    the file) would make readIndexedBases read the wrong bytes or fail.
+    @param entries of the index, see parseIndex
+    @param size of the input file
+    @return True if the index may describe the file
+*/
+bool checkIndex(std::vector<fai_entry_t> const & entries, uint64_t file_size){
+    uint64_t previous_end = 0;
+    for(fai_entry_t const & entry: entries){
+        uint64_t last = entry.length > 0 ? entry.length - 1 : 0;
+        uint64_t end_byte = entry.offset + (last / entry.line_bases) * entry.line_width + last % entry.line_bases + 1;
+        if(entry.offset < previous_end or end_byte > file_size)
+            return(false);
+        previous_end = end_byte;
+    }
+    return(true);
+}
+
+/**
+    Read a range of bases of an indexed record, skipping line breaks.
+    @param file descriptor of the input file
+    @param index entry of the record
+    @param position of the first base to read
+    @param number of bases to read
+    @param (output) the bases
+*/
+void readIndexedBases(int fd, fai_entry_t const & entry, uint64_t first, uint64_t nb_bases, std::string & bases){
+    bases.clear();
+    if(nb_bases == 0)
+        return;
+    uint64_t last = first + nb_bases - 1;
+    uint64_t begin_byte = entry.offset + (first / entry.line_bases) * entry.line_width + first % entry.line_bases;
+    uint64_t end_byte   = entry.offset + (last  / entry.line_bases) * entry.line_width + last  % entry.line_bases + 1;
+    std::string raw(end_byte - begin_byte, '\0');
+    ssize_t n = pread(fd, &raw[0], raw.size(), begin_byte);
+    if(n != ssize_t(raw.size()))
+        throw std::runtime_error("Index does not match input file");
+    for(char c: raw){
+        if(c != '\n' and c != '\r')
+            bases.push_back(c);
+    }
+    if(bases.size() != nb_bases)
+        throw std::runtime_error("Index does not match input file");
+}
+
+/**
+    Sample reads through an index: records are picked at random among the
+    index entries, and only their ends are read from disk.
+    @param path to the input file
+    @param path to its index
+    @param the reservoir to fill, see initReservoir
+    @param number of parallel readers
+    @param verbosity level
+    @return False if the index does not match the input, nothing is sampled then
+*/
+bool indexedSample(std::string input_file, std::string index_file, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+    std::vector<fai_entry_t> entries;
+    struct stat st;
+    try{
+        entries = parseIndex(index_file);
+    }
+    catch(std::runtime_error & e){
+        return(false);
+    }
+    if(stat(input_file.c_str(), &st) != 0 or not checkIndex(entries, st.st_size))
+        return(false);
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&reservoir](fai_entry_t const & entry){
+        return(not passLength(reservoir, entry.length));
+    }), entries.end());
+    uint64_t nb_sample = std::min(uint64_t(entries.size()), reservoir.capacity);
+
+    // sorted indices, reading in file order is friendlier to the disk
+    std::vector<uint64_t> vec = sampleIndices(entries.size(), nb_sample, reservoir.rng);
+
+    int fd = open(input_file.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "/!\\ COULD NOT OPEN INPUT FILE " << input_file << ", must quit\n";
+        exit(1);
+    }
+    std::vector<std::string> starts(nb_sample);
+    std::vector<std::string> ends(nb_sample);
+    bool failed = false;
+    #pragma omp parallel for num_threads(nb_thread) schedule(dynamic)
+    for(int64_t i = 0; i < int64_t(nb_sample); i++){
+        fai_entry_t const & entry = entries[vec[i]];
+        uint64_t current_cut_size = std::min(entry.length, reservoir.cut_size);
+        // exceptions must not leave the parallel region
+        try{
+            readIndexedBases(fd, entry, 0, current_cut_size, starts[i]);
+            readIndexedBases(fd, entry, entry.length - current_cut_size, current_cut_size, ends[i]);
+        }
+        catch(std::runtime_error & e){
+            #pragma omp atomic write
+            failed = true;
+        }
+    }
+    close(fd);
+    if(failed)
+        return(false);
+
+    for(uint64_t i = 0; i < nb_sample; i++){
+        reservoirStore(reservoir, i, starts[i], ends[i]);
+    }
+    reservoir.seen = entries.size();
+    if(v>0)
+        print("Indexed " + std::to_string(reservoir.seen) + " sequences, kept " + std::to_string(length(reservoir.starts)),1);
+    return(true);
+}
+
+
+/**
+    Read listed in a sequencing summary, eligible for sampling.
+*/
+struct summary_read_t{
+    double start_time;     // seconds since the start of the run
+    uint64_t line_offset;  // offset of its line in the summary, the read id is read back from it
+    uint32_t file;         // index of the file holding the read, in the input files
+};
+
+/**
+    Split a tab separated line.
+    @param the line
+    @param (output) the fields
+*/
+void splitFields(std::string const & line, std::vector<std::string> & fields){
+    fields.clear();
+    size_t start = 0;
+    while(true){
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if(tab == std::string::npos)
+            break;
+        start = tab + 1;
+    }
+    if(not fields.empty() and not fields.back().empty() and fields.back().back() == '\r')
+        fields.back().pop_back();
+}
+
+/**
+    Fetch the ends of some reads of a file. The index of the file is used
+    when there is one, otherwise the file is scanned and only the wanted
+    records are copied, the scan stopping once they are all found.
+    @param path to the file
+    @param ids of the wanted reads, with their position in the sample
+    @param the reservoir, for the cut size and the quality mask
+    @param (output) starts of the sampled reads
+    @param (output) ends of the sampled reads
+    @param (output) set to 1 for the reads found
+*/
+void fetchReads(std::string input_file, std::unordered_map<std::string, uint64_t> const & wanted, end_reservoir_t const & reservoir,
+                std::vector<std::string> & starts, std::vector<std::string> & ends, std::vector<char> & found){
+    uint64_t nb_found = 0;
+    std::string index_file = findIndex(input_file);
+    std::vector<std::string> names;
+    std::vector<fai_entry_t> entries;
+    struct stat st;
+    // an index does not give the qualities needed by the mask, a stale one is ignored
+    if(not index_file.empty() and reservoir.mask_quality == 0){
+        try{
+            entries = parseIndex(index_file, &names);
+        }
+        catch(std::runtime_error & e){
+            entries.clear();
+        }
+        if(stat(input_file.c_str(), &st) != 0 or not checkIndex(entries, st.st_size))
+            entries.clear();
+    }
+    if(not entries.empty()){
+        int fd = open(input_file.c_str(), O_RDONLY);
+        if(fd < 0){
+            std::cout << "/!\\ COULD NOT OPEN INPUT FILE " << input_file << ", must quit\n";
+            exit(1);
+        }
+        for(size_t i = 0; i < entries.size() and nb_found < wanted.size(); i++){
+            auto it = wanted.find(names[i]);
+            if(it == wanted.end())
+                continue;
+            uint64_t current_cut_size = std::min(entries[i].length, reservoir.cut_size);
+            readIndexedBases(fd, entries[i], 0, current_cut_size, starts[it->second]);
+            readIndexedBases(fd, entries[i], entries[i].length - current_cut_size, current_cut_size, ends[it->second]);
+            found[it->second] = 1;
+            nb_found++;
+        }
+        close(fd);
+        return;
+    }
+
+    std::string start_qual;
+    std::string end_qual;
+    mapped_file_t input(input_file);
+    if(input.mapped){
+        const char * cursor = input.data;
+        const char * end = input.data + input.size;
+        record_view_t view;
+        while(nb_found < wanted.size() and nextView(cursor, end, view)){
+            auto it = wanted.find(std::string(view.id, view.id_length));
+            if(it == wanted.end())
+                continue;
+            viewEnds(view, reservoir.cut_size, starts[it->second], ends[it->second]);
+            viewQualityEnds(view, reservoir.cut_size, start_qual, end_qual);
+            maskQuality(reservoir, starts[it->second], start_qual);
+            maskQuality(reservoir, ends[it->second], end_qual);
+            found[it->second] = 1;
+            nb_found++;
+        }
+        return;
+    }
+    std::unique_ptr<byte_source_t> source = openByteSource(input_file, 1);
+    ends_parser_t parser(source.get(), reservoir.cut_size);
+    parser.qualities = reservoir.mask_quality > 0;
+    bool bam = isBam(parser);
+    if(bam)
+        skipBamHeader(parser);
+    read_ends_t record;
+    while(nb_found < wanted.size() and (bam ? nextBamRecord(parser, record) : nextRecord(parser, record))){
+        auto it = wanted.find(record.id);
+        if(it == wanted.end())
+            continue;
+        maskQuality(reservoir, record.start, record.start_qual);
+        maskQuality(reservoir, record.end, record.end_qual);
+        starts[it->second] = record.start;
+        ends[it->second] = record.end;
+        found[it->second] = 1;
+        nb_found++;
+    }
+}
+
+/**
+    Sample reads from a MinKNOW / Dorado sequencing summary. Reads are
+    picked in the summary (passing filters, long enough, with a mean qscore
+    of at least the minimum quality), spread over the run time: eligible
+    reads are sorted by start time and one read is drawn per slice of the
+    run. Only the files holding the picked reads are then read, and only
+    the picked records are copied.
+    @param path to the sequencing summary
+    @param the input files, matched to the summary file names when there are several
+    @param the reservoir to fill, see initReservoir
+    @param number of parallel readers
+    @param verbosity level
+*/
+void summarySample(std::string summary_file, std::vector<std::string> const & input_files, end_reservoir_t & reservoir, uint64_t nb_thread, uint8_t v){
+    std::ifstream summary(summary_file);
+    if(not summary.is_open()){
+        std::cout << "/!\\ COULD NOT OPEN SEQUENCING SUMMARY " << summary_file << ", must quit\n";
+        exit(1);
+    }
+    // summaries only give file names, input files are matched on them
+    std::unordered_map<std::string, uint32_t> file_index;
+    for(uint32_t i = 0; i < input_files.size(); i++){
+        file_index[input_files[i].substr(input_files[i].find_last_of('/') + 1)] = i;
+    }
+
+    std::string line;
+    std::vector<std::string> fields;
+    getline(summary, line);
+    splitFields(line, fields);
+    uint64_t line_offset = line.size() + 1;
+    auto column = [&fields](std::initializer_list<std::string> names){
+        for(std::string const & name: names){
+            auto it = std::find(fields.begin(), fields.end(), name);
+            if(it != fields.end())
+                return(int64_t(it - fields.begin()));
+        }
+        return(int64_t(-1));
+    };
+    int64_t id_column      = column({"read_id"});
+    int64_t file_column    = column({"filename_fastq", "filename_bam", "filename"});
+    int64_t time_column    = column({"start_time"});
+    int64_t length_column  = column({"sequence_length_template"});
+    int64_t quality_column = column({"mean_qscore_template"});
+    int64_t passes_column  = column({"passes_filtering"});
+    if(id_column < 0 or (file_column < 0 and input_files.size() > 1)){
+        throw std::runtime_error("Sequencing summary without read_id or filename column: " + summary_file);
+    }
+    // a single input holds all the reads, whatever file name the summary gives
+    bool match_file = file_column >= 0 and input_files.size() > 1;
+
+    std::vector<summary_read_t> eligible;
+    uint64_t nb_malformed = 0;
+    for(; getline(summary, line); line_offset += line.size() + 1){
+        splitFields(line, fields);
+        if(int64_t(fields.size()) <= std::max({id_column, file_column, time_column, length_column, quality_column, passes_column}))
+            continue;
+        summary_read_t read = {0, line_offset, 0};
+        if(match_file){
+            auto it = file_index.find(fields[file_column]);
+            if(it == file_index.end())
+                continue;
+            read.file = it->second;
+        }
+        if(passes_column >= 0 and fields[passes_column] != "TRUE" and fields[passes_column] != "True" and fields[passes_column] != "true")
+            continue;
+        // rows with unreadable numbers (e.g. repeated headers of concatenated summaries) are skipped
+        try{
+            if(length_column >= 0 and not passLength(reservoir, std::stoull(fields[length_column])))
+                continue;
+            if(quality_column >= 0 and std::stod(fields[quality_column]) < reservoir.min_quality)
+                continue;
+            if(time_column >= 0)
+                read.start_time = std::stod(fields[time_column]);
+        }
+        catch(std::logic_error & e){
+            nb_malformed++;
+            continue;
+        }
+        eligible.push_back(read);
+    }
+    if(nb_malformed > 0)
+        std::cerr << "/!\\ WARNING: " << nb_malformed << " malformed rows of the sequencing summary were skipped" << std::endl;
+
+    // one read per slice of the run, slices holding the same number of reads
+    std::stable_sort(eligible.begin(), eligible.end(), [](summary_read_t const & a, summary_read_t const & b){
+        return(a.start_time < b.start_time);
+    });
+    uint64_t nb_sample = std::min(uint64_t(eligible.size()), reservoir.capacity);
+    std::vector<summary_read_t> picked(nb_sample);
+    for(uint64_t i = 0; i < nb_sample; i++){
+        uint64_t first = i * eligible.size() / nb_sample;
+        uint64_t last = (i + 1) * eligible.size() / nb_sample;
+        std::uniform_int_distribution<uint64_t> dist(first, last - 1);
+        picked[i] = eligible[dist(reservoir.rng)];
+    }
+
+    // read ids of the picked reads, read back in file order
+    std::vector<uint64_t> order(nb_sample);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&picked](uint64_t a, uint64_t b){
+        return(picked[a].line_offset < picked[b].line_offset);
+    });
+    std::vector<std::unordered_map<std::string, uint64_t> > wanted(input_files.size());
+    summary.clear();
+    for(uint64_t i: order){
+        summary.seekg(picked[i].line_offset);
+        getline(summary, line);
+        splitFields(line, fields);
+        wanted[picked[i].file][fields[id_column]] = i;
+    }
+
+    std::vector<uint32_t> files;
+    for(uint32_t i = 0; i < input_files.size(); i++){
+        if(not wanted[i].empty())
+            files.push_back(i);
+    }
+    std::vector<std::string> starts(nb_sample);
+    std::vector<std::string> ends(nb_sample);
+    std::vector<char> found(nb_sample, 0);
+    #pragma omp parallel for num_threads(nb_thread) schedule(dynamic)
+    for(int64_t i = 0; i < int64_t(files.size()); i++){
+        // exceptions must not leave the parallel region, the reads of a bad file are counted as not found
+        try{
+            fetchReads(input_files[files[i]], wanted[files[i]], reservoir, starts, ends, found);
+        }
+        catch(std::runtime_error & e){
+            #pragma omp critical
+            std::cerr << "/!\\ WARNING: " << input_files[files[i]] << " skipped: " << e.what() << std::endl;
+        }
+    }
+
+    uint64_t slot = 0;
+    for(uint64_t i = 0; i < nb_sample; i++){
+        if(not found[i])
+            continue;
+        reservoirStore(reservoir, slot, starts[i], ends[i]);
+        slot++;
+    }
+    reservoir.seen = eligible.size();
+    if(slot < nb_sample)
+        std::cerr << "/!\\ WARNING: " << nb_sample - slot << " reads of the sequencing summary were not found in their file" << std::endl;
+    if(v>0)
+        print("Picked " + std::to_string(nb_sample) + " of " + std::to_string(eligible.size()) + " eligible reads in the summary, fetched "
+              + std::to_string(slot) + " from " + std::to_string(files.size()) + " files",1);
+}
+
+
+/**
+    FNV-1a hash of a memory block.
+    @param the data to hash
+    @param size of the data
+    @param hash to continue from
+    @return the updated hash
+*/
+inline uint64_t fnv1a(const void * data, size_t size, uint64_t hash = FNV_OFFSET){
+    const unsigned char * bytes = (const unsigned char *) data;
+    for(size_t i = 0; i < size; i++){
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return(hash);
+}
+
+/**
+    Content fingerprint of a file: its size, plus evenly spaced blocks
+    covering the start, the middle and the end of the file. Reading the
+    whole file would cost as much as parsing it again.
+    @param path to the file
+    @return the fingerprint
+*/
+uint64_t fileFingerprint(std::string input_file){
+    if(not isRegularFile(input_file))
+        return(0);
+    int fd = open(input_file.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 or fstat(fd, &st) != 0){
+        if(fd >= 0)
+            close(fd);
+        return(0);
+    }
+    uint64_t size = st.st_size;
+    uint64_t hash = fnv1a(&size, sizeof(size));
+    std::vector<char> block(FINGERPRINT_BLOCK_SIZE);
+    for(uint64_t i = 0; i < FINGERPRINT_NB_BLOCKS; i++){
+        uint64_t offset = size > block.size() ? (size - block.size()) / (FINGERPRINT_NB_BLOCKS - 1) * i : 0;
+        ssize_t n = pread(fd, block.data(), block.size(), offset);
+        if(n > 0)
+            hash = fnv1a(block.data(), n, hash);
+    }
+    close(fd);
+    return(hash);
+}
+
+/**
+    Fingerprint of the sampled input: content of all its files, and
+    the settings that change which reads are sampled.
+    @param the input files
+    @param sampling settings, as text
+    @return the fingerprint
+*/
+uint64_t inputFingerprint(std::vector<std::string> const & input_files, std::string settings){
+    uint64_t hash = fnv1a(settings.data(), settings.size());
+    for(std::string const & input_file: input_files){
+        uint64_t file_hash = fileFingerprint(input_file);
+        hash = fnv1a(&file_hash, sizeof(file_hash), hash);
     }
-    s =  sum / float(2 * (k-2));
-    return s>= threshold;
+    return(hash);
 }
 
+/**
+    Header of a sample cache file. It is followed by the start and end
+    lengths (uint32 each), the positions of ambiguous bases (uint64 each)
+    and the bases themselves, 2 bit packed, 4 per byte. Every section is
+    aligned on 8 bytes so the file can be used mapped as is.
+*/
+struct sample_cache_header_t{
+    char magic[8];
+    uint64_t fingerprint;   // see inputFingerprint
+    uint64_t capacity;      // requested number of reads
+    uint64_t cut_size;      // size of the sampled portions
+    uint64_t seen;          // number of reads in the input
+    uint64_t nb_reads;      // number of sampled reads
+    uint64_t nb_bases;      // total number of bases, both ends included
+    uint64_t nb_ambiguous;  // number of ambiguous bases, stored as 'A'
+};
+
+const char SAMPLE_CACHE_MAGIC[8] = {'A', 'F', 'S', 'M', 'P', 'L', '0', '1'};
 
 /**
-    Check if the kmer is autorised or not
-    @param the kmer to test, in 2 bit representation, cast as an uint64_t int
-    @param a set containing the forbidden kmers
-    @return True if the kmer is contained in the set
+    Round a size up to a multiple of 8.
 */
-inline  bool isForbiddenKmer(uint64_t kmer, kmer_set_t & kmer_set){
-    return( kmer_set.find(kmer) != kmer_set.end() ) ;
+inline uint64_t align8(uint64_t size){
+    return((size + 7) & ~uint64_t(7));
 }
 
 /**
-    Parse a kmer list file and return a kmer set.
-    @param the file containging a list of kmer to exclude
-    @return A kmer set (set of uint64_t)
+    Save the sampled read ends in a compact binary cache.
+    @param path to the cache file
+    @param the filled reservoir
+    @param fingerprint of the input, see inputFingerprint
+    @return False if the file could not be written
 */
-kmer_set_t parse_kmer_list(std::string kmer_file){
-    
-    kmer_set_t kmer_set;
+bool saveSampleCache(std::string cache_file, end_reservoir_t const & reservoir, uint64_t fingerprint){
+    sample_cache_header_t header;
+    memcpy(header.magic, SAMPLE_CACHE_MAGIC, 8);
+    header.fingerprint = fingerprint;
+    header.capacity = reservoir.capacity;
+    header.cut_size = reservoir.cut_size;
+    header.seen = reservoir.seen;
+    header.nb_reads = length(reservoir.starts);
 
-    std::ifstream kmer_file_stream(kmer_file);
-    // parsing file
-    if( kmer_file_stream.is_open()) {
-        for( std::string line; getline( kmer_file_stream, line );){
-            // inserting new kmer
-            kmer_set.insert(dna2int(DnaString(line)));
+    std::vector<uint32_t> lengths;
+    std::vector<uint64_t> ambiguous;
+    std::vector<uint8_t> packed;
+    uint64_t pos = 0;
+    for(packed_sample_t const * set: {&reservoir.starts, &reservoir.ends}){
+        for(uint64_t i = 0; i < length(*set); i++){
+            packed_view_t seq = packedView(*set, i);
+            lengths.push_back(length(seq));
+            for(uint64_t j = 0; j < length(seq); j++){
+                uint8_t value = ordValue(seq[j]);
+                if(value > 3){
+                    ambiguous.push_back(pos);
+                    value = 0;
+                }
+                if(pos % 4 == 0)
+                    packed.push_back(0);
+                packed.back() |= value << (2 * (pos % 4));
+                pos++;
+            }
         }
-        kmer_file_stream.close();
     }
-    else{
-        std::cout << "/!\\ COULD NOT OPEN EXCLUDED KMER FILE, must quit\n";
-        exit(1);
+    header.nb_bases = pos;
+    header.nb_ambiguous = ambiguous.size();
+
+    std::ofstream cache(cache_file, std::ios::binary);
+    if(not cache.is_open()){
+        print("COULD NOT OPEN FILE " + cache_file);
+        return(false);
     }
-    return(kmer_set);
+    const char padding[8] = {0};
+    cache.write((const char *) &header, sizeof(header));
+    cache.write((const char *) lengths.data(), lengths.size() * sizeof(uint32_t));
+    cache.write(padding, align8(lengths.size() * sizeof(uint32_t)) - lengths.size() * sizeof(uint32_t));
+    cache.write((const char *) ambiguous.data(), ambiguous.size() * sizeof(uint64_t));
+    cache.write((const char *) packed.data(), packed.size());
+    return(cache.good());
 }
 
 /**
-    Return the solid kmers. Kmer with count over threshold will be kept.
-    @param kmer count map (see count_kmer and error count)
-    @param The minimum abundance of the kmers to return
-    @return vector of pair containing the solids kmers and their associated count.
+    Load the sampled read ends from a binary cache, if it matches the input.
+    @param path to the cache file
+    @param the reservoir to fill, see initReservoir
+    @param fingerprint of the input, see inputFingerprint
+    @return False if the cache is missing or does not match
 */
-pair_vector get_solid_kmers(counter & count_map, uint64_t solid_km){
+bool loadSampleCache(std::string cache_file, end_reservoir_t & reservoir, uint64_t fingerprint){
+    mapped_file_t cache(cache_file);
+    if(not cache.mapped or cache.size < sizeof(sample_cache_header_t))
+        return(false);
+    sample_cache_header_t header;
+    memcpy(&header, cache.data, sizeof(header));
+    if(memcmp(header.magic, SAMPLE_CACHE_MAGIC, 8) != 0 or header.fingerprint != fingerprint
+       or header.capacity != reservoir.capacity or header.cut_size != reservoir.cut_size
+       or header.nb_reads > header.capacity or header.nb_ambiguous > header.nb_bases
+       or header.nb_bases > 2 * header.nb_reads * header.cut_size)
+        return(false);
 
-    pair_vector kmer_vec(std::make_move_iterator(count_map.begin()), std::make_move_iterator(count_map.end()));
-    std::sort(kmer_vec.begin(), kmer_vec.end(), [](auto x, auto y){ return x.second > y.second;} );
-    uint64_t limit = 0;
-    // Finding the position in the vector where kmer count is no longer high enough
-    for(auto kmer_count: kmer_vec){
-        if(kmer_count.second >= solid_km ){
-            limit ++;
-        }
-        else{
-            break;
+    uint64_t lengths_size = align8(2 * header.nb_reads * sizeof(uint32_t));
+    uint64_t expected = sizeof(header) + lengths_size + header.nb_ambiguous * sizeof(uint64_t) + (header.nb_bases + 3) / 4;
+    if(cache.size != expected)
+        return(false);
+    const uint32_t * lengths = (const uint32_t *) (cache.data + sizeof(header));
+    const uint64_t * ambiguous = (const uint64_t *) (cache.data + sizeof(header) + lengths_size);
+    const uint8_t * packed = (const uint8_t *) (ambiguous + header.nb_ambiguous);
+    // a corrupted cache must not make the reads overflow their slot or the packed bases
+    uint64_t nb_bases = 0;
+    for(uint64_t i = 0; i < 2 * header.nb_reads; i++){
+        if(lengths[i] > header.cut_size)
+            return(false);
+        nb_bases += lengths[i];
+    }
+    if(nb_bases != header.nb_bases)
+        return(false);
+
+    initPacked(reservoir.starts, reservoir.cut_size);
+    initPacked(reservoir.ends, reservoir.cut_size);
+    uint64_t pos = 0;
+    uint64_t next_ambiguous = 0;
+    Dna5String seq;
+    for(packed_sample_t * set: {&reservoir.starts, &reservoir.ends}){
+        for(uint64_t i = 0; i < header.nb_reads; i++){
+            resize(seq, *lengths++);
+            for(uint64_t j = 0; j < length(seq); j++){
+                if(next_ambiguous < header.nb_ambiguous and ambiguous[next_ambiguous] == pos){
+                    seq[j] = 'N';
+                    next_ambiguous++;
+                }
+                else{
+                    seq[j] = DNA[(packed[pos / 4] >> (2 * (pos % 4))) & 3];
+                }
+                pos++;
+            }
+            packedStore(*set, i, seq);
         }
     }
-    kmer_vec.resize(limit);
-    return(kmer_vec);
+    reservoir.seen = header.seen;
+    return(true);
 }
 
 /**
-    Return the first top kmers, ranked by count, descending.
-    @param kmer count map (see count_kmer and error count)
-    @param number of kmers to return
-    @return vector of pair containing the most frequent kmers and their associated count.
+    Header of a forbidden k-mer filter file. It is followed by the Bloom
+    filter blocks and the sorted k-mers, as in kmer_filter_t.
 */
-pair_vector get_most_frequent(counter & count_map, uint64_t limit){
+struct kmer_filter_header_t{
+    char magic[8];
+    uint64_t k;             // size of the k-mers, 0 if unknown
+    uint64_t canonical;     // 1 if the k-mers are in canonical form
+    uint64_t fingerprint;   // of the source reference, see fileFingerprint
+    uint64_t nb_words;      // size of the Bloom filter, in words
+    uint64_t nb_kmers;      // number of forbidden k-mers
+};
 
-    pair_vector kmer_vec(std::make_move_iterator(count_map.begin()), std::make_move_iterator(count_map.end()));
-    std::sort(kmer_vec.begin(), kmer_vec.end(), [](auto x, auto y){ return x.second > y.second;} );
-    if(kmer_vec.size() > limit){
-        kmer_vec.resize(limit);
+const char KMER_FILTER_MAGIC[8] = {'A', 'F', 'K', 'M', 'F', 'L', '0', '4'};
+
+/**
+    Save a forbidden k-mer filter, so later runs load it without parsing
+    the k-mer list again.
+    @param path to the filter file
+    @param the filter
+    @return False if the file could not be written
+*/
+bool saveKmerFilter(std::string filter_file, kmer_filter_t const & filter){
+    kmer_filter_header_t header;
+    memcpy(header.magic, KMER_FILTER_MAGIC, 8);
+    header.k = filter.k;
+    header.canonical = filter.canonical;
+    header.fingerprint = filter.fingerprint;
+    header.nb_words = filter.blocks.size();
+    header.nb_kmers = filter.kmers.size();
+    std::ofstream output(filter_file, std::ios::binary);
+    if(not output.is_open()){
+        print("COULD NOT OPEN FILE " + filter_file);
+        return(false);
     }
-    return(kmer_vec);
+    output.write((const char *) &header, sizeof(header));
+    output.write((const char *) filter.blocks.data(), filter.blocks.size() * sizeof(uint64_t));
+    output.write((const char *) filter.kmers.data(), filter.kmers.size() * sizeof(uint64_t));
+    return(output.good());
 }
 
-
 /**
-    Sample the sequences set and return requested samples cut to size
-    @param Set of sequences to sample (SeqAn StringSet of DnaString)
-    @param Number of sequences to sample
-    @param Size of the sampled sequence.
-    @return A set of sample sequences cut to size.
+    Load a forbidden k-mer filter saved by saveKmerFilter.
+    @param path to the filter file
+    @param (output) the filter
+    @return False if the file is not a k-mer filter (a k-mer list, for example)
 */
-sequence_set_type sampleSequences(sequence_set_type & sequence_set, uint64_t nb_sample, uint64_t cut_size, bool bot, uint8_t v){
-    sequence_set_type sample;
-    
-    // Initialising the random seed
-    srand(time(0));
+bool loadKmerFilter(std::string filter_file, kmer_filter_t & filter){
+    mapped_file_t mapped(filter_file);
+    if(not mapped.mapped or mapped.size < sizeof(kmer_filter_header_t)
+       or memcmp(mapped.data, KMER_FILTER_MAGIC, 6) != 0)
+        return(false);
+    // older filters have another header
+    if(memcmp(mapped.data, KMER_FILTER_MAGIC, 8) != 0)
+        throw std::runtime_error("Forbidden k-mer filter " + filter_file + " was written by an older version, it must be built again");
+    kmer_filter_header_t header;
+    memcpy(&header, mapped.data, sizeof(header));
+    if(mapped.size != sizeof(header) + (header.nb_words + header.nb_kmers) * sizeof(uint64_t)
+       or header.nb_words == 0 or header.nb_words % BLOOM_BLOCK_WORDS != 0)
+        throw std::runtime_error("Corrupted forbidden k-mer filter " + filter_file);
+    const uint64_t * words = (const uint64_t *) (mapped.data + sizeof(header));
+    filter.k = header.k;
+    filter.canonical = header.canonical != 0;
+    filter.fingerprint = header.fingerprint;
+    filter.blocks.assign(words, words + header.nb_words);
+    filter.kmers.assign(words + header.nb_words, words + header.nb_words + header.nb_kmers);
+    return(true);
+}
 
-    uint64_t sequence_set_size = length(sequence_set);
-    // Building vector with all possible seq indice
-    std::vector<int> vec(sequence_set_size) ; 
-    std::iota(std::begin(vec), std::end(vec), 0);
+/**
+    Check if a file (possibly compressed) is in FASTA format: its first
+    non blank character is '>', which never starts a k-mer list.
+    @param path to the file
+    @return True for a FASTA file
+*/
+bool isFastaFile(std::string path){
+    if(not isRegularFile(path))
+        return(false);
+    std::unique_ptr<byte_source_t> source = openByteSource(path, 1);
+    std::vector<char> buffer(1 << 12);
+    size_t n = source->read(buffer.data(), buffer.size());
+    for(size_t i = 0; i < n; i++){
+        if(not std::isspace(buffer[i]))
+            return(buffer[i] == '>');
+    }
+    return(false);
+}
 
-    // and applying random shuffling to said vector.
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(vec.begin(), vec.end(), g);
+/**
+    Add the canonical k-mers of a slice of a reference sequence to a list.
+    The slice owns the k-mers ending in it: scanning starts k - 1 bases
+    earlier, so no k-mer is lost between slices.
+    @param the reference file content
+    @param offset of the first sequence byte of the record
+    @param offset of the first byte of the slice
+    @param offset past the last byte of the slice
+    @param k, size of the kmers
+    @param (output) the list of kmers
+*/
+void referenceKmers(const char * data, uint64_t record_start, uint64_t begin, uint64_t end, uint8_t k, std::vector<uint64_t> & kmers){
+    uint64_t pos = begin;
+    for(uint64_t nb_back = 0; pos > record_start and nb_back + 1 < k;){
+        pos--;
+        if(data[pos] != '\n' and data[pos] != '\r')
+            nb_back++;
+    }
+    uint64_t base = k < 32 ? (uint64_t(1) << (2 * k)) - 1 : ~uint64_t(0);
+    uint64_t kmer = 0;
+    uint64_t reverse = 0; // reverse complement of the kmer
+    uint64_t valid = 0;   // number of consecutive unambiguous bases
+    for(; pos < end; pos++){
+        if(data[pos] == '\n' or data[pos] == '\r')
+            continue;
+        uint8_t c = ordValue(Dna5(data[pos]));
+        if(c > 3){
+            valid = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | c) & base;
+        reverse = (reverse >> 2) | (uint64_t(3 - c) << (2 * (k - 1)));
+        valid++;
+        if(valid >= k and pos >= begin)
+            kmers.push_back(std::min(kmer, reverse));
+    }
+}
 
-    // counters
-    uint64_t nb_seq = 0;
-    uint64_t i = 0;
-    uint64_t seq_id;
+/**
+    Build the forbidden k-mer filter of a reference (genome, plasmid...),
+    from all its canonical k-mers. Sequences are cut in slices of
+    REFERENCE_SLICE_SIZE bytes, scanned in parallel.
+    @param path to the reference FASTA file, possibly compressed
+    @param k, size of the kmers
+    @param number of thread to use
+    @return the filter
+*/
+kmer_filter_t buildReferenceFilter(std::string reference, uint8_t k, uint64_t nb_thread){
+    // uncompressed references are used mapped, others are decompressed in memory
+    mapped_file_t mapped(reference);
+    std::string content;
+    if(not mapped.mapped){
+        std::unique_ptr<byte_source_t> source = openByteSource(reference, nb_thread);
+        std::vector<char> buffer(READ_BUFFER_SIZE);
+        while(size_t n = source->read(buffer.data(), buffer.size()))
+            content.append(buffer.data(), n);
+    }
+    const char * data = mapped.mapped ? mapped.data : content.data();
+    uint64_t size = mapped.mapped ? mapped.size : content.size();
 
-    // display
-    if(v>0){
-        if(bot){
-            print("Sampling the ends of reads",1);
+    // slices of the sequences: record start, slice begin and end
+    std::vector<std::array<uint64_t, 3> > slices;
+    uint64_t pos = 0;
+    while(pos < size){
+        const char * line_end = (const char *) memchr(data + pos, '\n', size - pos);
+        uint64_t next = line_end ? line_end - data + 1 : size;
+        if(data[pos] != '>'){
+            pos = next;
+            continue;
         }
-        else{
-            print("Sampling the start of reads",1);
+        // sequence of the record, up to the next header
+        uint64_t record_start = next;
+        uint64_t record_end = next;
+        while(record_end < size and data[record_end] != '>'){
+            line_end = (const char *) memchr(data + record_end, '\n', size - record_end);
+            record_end = line_end ? line_end - data + 1 : size;
         }
+        for(uint64_t begin = record_start; begin < record_end; begin += REFERENCE_SLICE_SIZE)
+            slices.push_back({record_start, begin, std::min(begin + REFERENCE_SLICE_SIZE, record_end)});
+        pos = record_end;
     }
 
-    // Fetching the random sequences
-    while(nb_seq < nb_sample and i < sequence_set_size ){
-        
-        // current sequence id
-        seq_id = vec[i];
-        
-        // asjusting cut size to read length, if it is too short.
-        uint64_t current_cut_size = std::min(uint64_t(length(sequence_set[ seq_id ])), cut_size);
-
-        if(current_cut_size < cut_size and v >= 2){
-            print("/!\\Cut size is longer that current read!");
+    kmer_filter_t filter;
+    filter.k = k;
+    filter.canonical = true;
+    std::vector<std::vector<uint64_t> > thread_kmers(nb_thread);
+    omp_set_num_threads(nb_thread);
+    #pragma omp parallel
+    {
+        std::vector<uint64_t> & kmers = thread_kmers[omp_get_thread_num()];
+        std::vector<uint64_t> slice_kmers;
+        // duplicates are removed slice by slice, to keep memory down
+        #pragma omp for schedule(dynamic)
+        for(uint64_t i = 0; i < slices.size(); i++){
+            slice_kmers.clear();
+            referenceKmers(data, slices[i][0], slices[i][1], slices[i][2], k, slice_kmers);
+            std::sort(slice_kmers.begin(), slice_kmers.end());
+            kmers.insert(kmers.end(), slice_kmers.begin(), std::unique(slice_kmers.begin(), slice_kmers.end()));
         }
+        std::sort(kmers.begin(), kmers.end());
+        kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+    }
+    for(std::vector<uint64_t> & kmers: thread_kmers){
+        filter.kmers.insert(filter.kmers.end(), kmers.begin(), kmers.end());
+        std::vector<uint64_t>().swap(kmers);
+    }
+    buildKmerFilter(filter, nb_thread);
+    return(filter);
+}
 
-        // // we also need to check that the sequence is
-        // // at least long enough to contains both adapters.
-        // if( length(sequence_set[ seq_id ]) >= cut_size * 2 ){
-        if(bot){
-            appendValue(sample, suffix(sequence_set[ seq_id ], length(sequence_set[ seq_id ]) - 1 - current_cut_size ));
-        }
-        else{
-            appendValue(sample, prefix(sequence_set[ seq_id ], current_cut_size));
-        }
-        
-        nb_seq +=1;
-        // }
-        i++;
+/**
+    Forbidden k-mer filter of a reference, cached next to it (one cache
+    file per k) so the reference is only scanned again when it changes.
+    @param path to the reference FASTA file, possibly compressed
+    @param k, size of the kmers
+    @param number of thread to use
+    @param verbosity level
+    @return the filter
+*/
+kmer_filter_t referenceFilter(std::string reference, uint8_t k, uint64_t nb_thread, uint8_t v){
+    std::string cache_file = reference + ".k" + std::to_string(k) + ".afk";
+    uint64_t fingerprint = fileFingerprint(reference);
+    kmer_filter_t filter;
+    bool loaded = false;
+    // a corrupted or outdated cache is built again
+    try{
+        loaded = loadKmerFilter(cache_file, filter);
+    }
+    catch(std::runtime_error & e){
+        loaded = false;
+    }
+    if(loaded and filter.k == k and filter.fingerprint == fingerprint){
+        if(v>0)
+            print("Loaded the forbidden kmer filter from " + cache_file);
+        return(filter);
     }
     if(v>0)
-        print("Sampled " + std::to_string(length(sample)) + " sequences",1);
-    return(sample);
+        print("Building the forbidden kmer filter of reference " + reference);
+    filter = buildReferenceFilter(reference, k, nb_thread);
+    filter.fingerprint = fingerprint;
+    if(v>0)
+        print(std::to_string(filter.kmers.size()) + " forbidden kmers, saved to " + cache_file);
+    if(not saveKmerFilter(cache_file, filter))
+        std::cerr << "/!\\ WARNING: Failed to write the forbidden kmer filter cache" << std::endl;
+    return(filter);
 }
 
 
 /**
-    Perform a simple exact count of all the k-mers from a sample set of sequences
-    @param Set of sequences (SeqAn StringSet of DnaString)
+    Perform a simple exact count of all the k-mers from a sample set of sequences.
+    Ambiguous bases (N) reset the k-mer window, no k-mer spans them.
+    Reads are split between threads, each counting in its own table,
+    and tables are then added to the first one.
+    @param Set of sequences (packed sample)
     @param k, size of the kmers
     @param threshold of the low complexity filter
+    @param set of forbidden kmers
+    @param number of thread to use
     @return a map of the kmer count, with a kmer hash as key.
 
 */
-counter count_kmers(sequence_set_type & sequences, uint8_t k, float threshold, kmer_set_t & kmer_set){
+counter count_kmers(packed_sample_t const & sequences, uint8_t k, float threshold, kmer_filter_t const & kmer_set, uint64_t nb_thread){
 
-    counter count;
-    uint64_t base = std::pow(2,(2*k))-1;
-    for(auto seq: sequences){
-        // First kmer
-        uint64_t n = dna2int(DnaString(prefix(seq,k-1)));
-        int i = k-1;
-        while(i < length(seq)){ 
-            
-            n <<= 2; 
-            n = (n & base) |  (uint8_t)(seq[i]);
-            if(not haveLowComplexity(n,k,threshold) and not isForbiddenKmer(n,kmer_set)){
-                count[n] +=1 ;
-            }           
-            i++;
+    nb_thread = std::max<uint64_t>(1, std::min<uint64_t>(nb_thread, length(sequences)));
+    uint64_t nb_bases = std::accumulate(sequences.lengths.begin(), sequences.lengths.end(), uint64_t(0));
+    std::vector<counter> counts(nb_thread);
+    omp_set_num_threads(nb_thread);
+    #pragma omp parallel
+    {
+        counter & count = counts[omp_get_thread_num()];
+        count.reserve(maxDistinctKmers(nb_bases / nb_thread, k));
+        #pragma omp for schedule(static)
+        for(uint64_t i = 0; i < length(sequences); i++){
+            updateKmerCount(count, packedView(sequences, i), k, threshold, kmer_set);
+        }
+    }
+    // largest table first, fewer insertions
+    std::sort(counts.begin(), counts.end(), [](counter const & a, counter const & b){ return(a.size() > b.size()); });
+    for(uint64_t t = 1; t < nb_thread; t++){
+        for(auto const & kmer_count: counts[t])
+            counts[0][kmer_count.first] += kmer_count.second;
+        counts[t] = counter();
+    }
+    return(std::move(counts[0]));
+}
+
+/**
+    Exact count of the k-mers of a sample, for small k (see DENSE_MAX_K):
+    counts are stored in a flat array indexed by the 2 bit k-mer, with no
+    hashing nor per k-mer allocation. Below DENSE_LOCAL_MAX_K, each thread
+    fills its own array, and arrays are added at the end. Above, a single
+    array is shared and updated with atomic increments.
+    @param Set of sequences (packed sample)
+    @param k, size of the kmers, at most DENSE_MAX_K
+    @param threshold of the low complexity filter
+    @param set of forbidden kmers
+    @param number of thread to use
+    @return the count of each kmer, indexed by kmer
+*/
+dense_counter dense_count_kmers(packed_sample_t const & sequences, uint8_t k, float threshold, kmer_filter_t const & kmer_set, uint64_t nb_thread){
+
+    uint64_t nb_kmers = uint64_t(1) << (2 * k);
+    nb_thread = std::max<uint64_t>(1, std::min<uint64_t>(nb_thread, length(sequences)));
+    omp_set_num_threads(nb_thread);
+    if(k > DENSE_LOCAL_MAX_K){
+        dense_counter count(nb_kmers, 0);
+        #pragma omp parallel for schedule(static)
+        for(uint64_t i = 0; i < length(sequences); i++){
+            forEachKmer(packedView(sequences, i), k, threshold, kmer_set, [&count](uint64_t n){
+                #pragma omp atomic update
+                count[n]++;
+            });
+        }
+        return(count);
+    }
+    std::vector<dense_counter> counts(nb_thread, dense_counter(nb_kmers, 0));
+    #pragma omp parallel
+    {
+        dense_counter & count = counts[omp_get_thread_num()];
+        #pragma omp for schedule(static)
+        for(uint64_t i = 0; i < length(sequences); i++){
+            forEachKmer(packedView(sequences, i), k, threshold, kmer_set, [&count](uint64_t n){
+                count[n]++;
+            });
+        }
+    }
+    for(uint64_t t = 1; t < nb_thread; t++){
+        for(uint64_t kmer = 0; kmer < nb_kmers; kmer++)
+            counts[0][kmer] += counts[t][kmer];
+    }
+    return(std::move(counts[0]));
+}
+
+
+/**
+    Split sequences on ambiguous bases, so the index never contains them.
+    Fragments too short to hold a k-mer at MAXERR errors are dropped.
+    SeqAn indexes its own copy of the text, fragments are unpacked
+    straight from the packed sample into the index string set.
+    @param Set of sequences (packed sample)
+    @param k, size of the kmers
+    @param (output) the unambiguous fragments
+    @param (output) for each fragment, the index of its sequence
+*/
+void splitAmbiguous(packed_sample_t const & sequences, uint8_t k, StringSet<DnaString> & fragments, std::vector<uint32_t> & fragment_read){
+    uint64_t min_length = k > MAXERR ? k - MAXERR : 1;
+    DnaString fragment;
+    for(uint64_t read_id = 0; read_id < length(sequences); read_id++){
+        packed_view_t seq = packedView(sequences, read_id);
+        uint64_t start = 0;
+        for(uint64_t i = 0; i <= length(seq); i++){
+            if(i == length(seq) or ordValue(seq[i]) > 3){
+                if(i - start >= min_length){
+                    resize(fragment, i - start);
+                    for(uint64_t j = start; j < i; j++)
+                        fragment[j - start] = Dna(seq[j]);
+                    appendValue(fragments, fragment);
+                    fragment_read.push_back(read_id);
+                }
+                start = i + 1;
+            }
         }
     }
-    return(count);
 }
 
 
 /**
     Search and count a list of kmer in a set of sequences, at a Levenstein distance of at most 2.
-    @param Set of sequences (SeqAn StringSet of DnaString)
+    @param Set of sequences (packed sample)
     @param the previous count of exact kmer (the kmer list)
     @param number of thread to use
     @param k, size of the kmers
     @return a map of the kmer count, with a kmer hash as key.
 
 */
-counter errorCount( sequence_set_type & sequences, pair_vector & exact_count, uint8_t nb_thread, uint8_t k, uint8_t v){
+counter errorCount( packed_sample_t const & sequences, pair_vector & exact_count, uint8_t nb_thread, uint8_t k, uint8_t v){
     
 
     uint64_t sample_size = length(sequences);
     if(v>0)
         print("Preparing index",1);
-    index_t  index(sequences);
+    // ambiguous positions are excluded from the index
+    StringSet<DnaString> fragments;
+    std::vector<uint32_t> fragment_read;
+    splitAmbiguous(sequences, k, fragments, fragment_read);
+    index_t  index(fragments);
     
     if(v>0)
         print("Creating index",1);
@@ -436,6 +4165,7 @@ counter errorCount( sequence_set_type & sequences, pair_vector & exact_count, ui
     
     // Result storage
     counter results;
+    results.reserve(length(exact_count));
 
     // setting number of parallel thread
     omp_set_num_threads(nb_thread);
@@ -447,11 +4177,11 @@ counter errorCount( sequence_set_type & sequences, pair_vector & exact_count, ui
         std::array<bit_field,3> tcount;
 
         // Delegate function for SeqAn find function (process occurences)
-        auto delegateParallel = [& tcount](auto & iter, const DnaString & needle, int errors)
+        auto delegateParallel = [& tcount, & fragment_read](auto & iter, const DnaString & needle, int errors)
         {
             for (auto occ : getOccurrences(iter)){
                 
-                uint64_t read_id = getValueI1(occ);
+                uint64_t read_id = fragment_read[getValueI1(occ)];
                 tcount[errors][read_id] = true;
                 }
         };
@@ -493,6 +4223,129 @@ counter errorCount( sequence_set_type & sequences, pair_vector & exact_count, ui
 }
 
 
+/**
+    Export a counter through a temporary file renamed over the output,
+    so readers never see a half written file.
+    @param the counter to export, see exportCounter
+    @param k, the size of the kmers
+    @param the path to the output file
+*/
+bool publishCounter(pair_vector & pvec, uint8_t k, std::string output){
+    std::string temporary = output + ".tmp";
+    if(not exportCounter(pvec, k, temporary))
+        return(false);
+    if(rename(temporary.c_str(), output.c_str()) != 0){
+        print("COULD NOT OPEN FILE " + output);
+        return(false);
+    }
+    return(true);
+}
+
+/**
+    Check if a sequencing run is over: MinKNOW writes a final summary
+    (final_summary_*.txt) in the run directory, the parent of fastq_pass.
+    @param the watched directory
+    @return True once the final summary exists
+*/
+bool runFinished(std::string run_dir){
+    bool finished = false;
+    for(std::string pattern: {run_dir + "/final_summary*.txt", run_dir + "/../final_summary*.txt"}){
+        glob_t matches;
+        finished = finished or (glob(pattern.c_str(), 0, nullptr, &matches) == 0 and matches.gl_pathc > 0);
+        globfree(&matches);
+    }
+    return(finished);
+}
+
+/**
+    Watch a run directory while it is sequencing. New files are folded into
+    the reservoir (which keeps its k-mer counts up to date, see enableCounting)
+    as soon as MinKNOW is done writing them, that is when their size did not
+    change for one polling interval. After each batch of new files, the top
+    k-mers are ranked again, and the approximate count is only run again, and
+    the outputs republished, when the top k-mer set of an end changed.
+    Watching stops once the run is over (see runFinished). A file that
+    cannot be read is reported and skipped.
+    @param the watched directory
+    @param the reservoir, counting its k-mers
+    @param number of threads
+    @param polling interval, in seconds
+    @param number of kmers to keep
+    @param solid k-mer threshold, 0 to keep the most frequent kmers
+    @param k, size of the kmers
+    @param True to skip the end adapter
+    @param path to the approximate count output
+    @param path to the exact count output, empty if not needed
+    @param verbosity level
+    @return 0 on success, 1 if an output could not be written
+*/
+int watchRun(std::string run_dir, end_reservoir_t & reservoir, uint64_t nb_thread, uint64_t interval, uint64_t limit, uint64_t solid_km,
+             uint8_t k, bool skip_end, std::string output, std::string exact_out, uint8_t v){
+    std::map<std::string, std::pair<off_t, time_t> > pending; // files seen, not read yet
+    std::set<std::string> done;
+    std::vector<kmer_set_t> top_kmers(2);
+    bool finished = false;
+    while(not finished){
+        // checked first, so files written before the final summary are all read in the last round
+        finished = runFinished(run_dir);
+        uint64_t nb_new = 0;
+        for(std::string const & file: listInputFiles(run_dir)){
+            struct stat st;
+            if(done.count(file) > 0 or stat(file.c_str(), &st) != 0)
+                continue;
+            std::pair<off_t, time_t> state(st.st_size, st.st_mtime);
+            auto it = pending.find(file);
+            if(not finished and (it == pending.end() or it->second != state)){
+                pending[file] = state;
+                continue;
+            }
+            pending.erase(file);
+            done.insert(file);
+            // a bad file is not read again, its records read so far are already in the reservoir
+            try{
+                streamFile(file, reservoir, nb_thread);
+            }
+            catch(std::runtime_error & e){
+                std::cerr << "/!\\ WARNING: " << file << " skipped: " << e.what() << std::endl;
+            }
+            nb_new++;
+        }
+        if(nb_new > 0){
+            if(v>0)
+                print("Read " + std::to_string(nb_new) + " new files, " + std::to_string(reservoir.seen) + " sequences so far",0);
+            for(int bottom = 0; bottom < (skip_end ? 1 : 2); bottom++){
+                std::string which_end = bottom ? "end" : "start";
+                // ranking copies the counts out, the counter is left as is
+                counter & count = bottom ? reservoir.end_count : reservoir.start_count;
+                pair_vector first_n_vector = solid_km != 0 ? get_solid_kmers(count, solid_km) : get_most_frequent(count, limit);
+                if(not exact_out.empty() and not publishCounter(first_n_vector, k, exact_out + "." + which_end))
+                    return(1);
+                kmer_set_t top;
+                for(auto const & kmer_count: first_n_vector)
+                    top.insert(kmer_count.first);
+                if(top == top_kmers[bottom]){
+                    if(v>0)
+                        print("Top k-mers of the " + which_end + " unchanged, approximate count kept",1);
+                    continue;
+                }
+                top_kmers[bottom] = std::move(top);
+                packed_sample_t & sample = bottom ? reservoir.ends : reservoir.starts;
+                counter error_counter = errorCount(sample, first_n_vector, nb_thread, k, v);
+                pair_vector sorted_error_count = get_most_frequent(error_counter, limit);
+                if(not publishCounter(sorted_error_count, k, output + "." + which_end))
+                    return(1);
+                if(v>0)
+                    print("Published " + output + "." + which_end,1);
+            }
+        }
+        if(not finished)
+            std::this_thread::sleep_for(std::chrono::seconds(interval));
+    }
+    if(v>0)
+        print("Run is over, " + std::to_string(done.size()) + " files read",0);
+    return(0);
+}
+
 
 
 int main(int argc, char const ** argv)
@@ -513,7 +4366,7 @@ int main(int argc, char const ** argv)
         seqan::ArgParseArgument::INTEGER, "INT"));
 
     addOption(parser, seqan::ArgParseOption(
-        "sl", "sample_length", "size of the sampled portion, default 100 bases",
+        "sl", "sample_length", "size of the sampled portion at each end of the reads, default 100 bases",
         seqan::ArgParseArgument::INTEGER, "INT"));
 
     addOption(parser, seqan::ArgParseOption(
@@ -541,9 +4394,13 @@ int main(int argc, char const ** argv)
         seqan::ArgParseArgument::STRING, "config file"));
 
     addOption(parser, seqan::ArgParseOption(
-        "fk", "forbidden_kmer", "take a file containing 'forbidden' kmers, excluding them from the search pool. One kmer per line.",
+        "fk", "forbidden_kmer", "take a file containing 'forbidden' kmers, excluding them from the search pool. One kmer per line, a filter saved with -fs, or a reference FASTA file whose kmers are all forbidden.",
         seqan::ArgParseArgument::STRING, "config file"));
 
+    addOption(parser, seqan::ArgParseOption(
+        "fs", "forbidden_save", "save the forbidden kmers (-fk) in a binary filter file, loaded much faster by later runs.",
+        seqan::ArgParseArgument::STRING, "STRING"));
+
     addOption(parser, seqan::ArgParseOption(
         "sk", "solid_km", "Use solid kmer instead of most frequents. This option will override sample number (-sn / --sample_n).",
         seqan::ArgParseArgument::INTEGER, "INT"));
@@ -552,6 +4409,46 @@ int main(int argc, char const ** argv)
         "se", "skip_end", "Skip end adapter ressearch (only search start). /!\\ If this option is set, and adaptFinder is run trough PorechopABI, the --guess_only / -go MUST be set."
         ));
 
+    addOption(parser, seqan::ArgParseOption(
+        "st", "stream", "Stream the input and keep a reservoir of read ends instead of loading the whole file. Lower memory usage, one pass."
+        ));
+
+    addOption(parser, seqan::ArgParseOption(
+        "ro", "random_offsets", "Sample reads at random byte offsets of an uncompressed (or multi-frame Zstandard) input, without reading the whole file. Favours long reads."
+        ));
+
+    addOption(parser, seqan::ArgParseOption(
+        "ml", "min_length", "minimum read length, shorter reads are not sampled. Default 0 (no filter), reads shorter than twice the sample length have overlapping ends",
+        seqan::ArgParseArgument::INTEGER, "INT"));
+
+    addOption(parser, seqan::ArgParseOption(
+        "ls", "length_stratified", "Stratify the sample on read length: each octave of length (1-2 kb, 2-4 kb...) gets an equal share of the sampled reads. Implies --stream."
+        ));
+
+    addOption(parser, seqan::ArgParseOption(
+        "mq", "min_quality", "minimum mean quality (Phred) of both sampled ends of a read, lower quality reads are not sampled. FASTQ and BAM only, default 0 (no filter)",
+        seqan::ArgParseArgument::DOUBLE, "DOUBLE"));
+
+    addOption(parser, seqan::ArgParseOption(
+        "qm", "quality_mask", "mask the bases of the sampled ends with a lower quality (Phred), so that no k-mer is counted over them. FASTQ and BAM only, default 0 (no masking)",
+        seqan::ArgParseArgument::INTEGER, "INT"));
+
+    addOption(parser, seqan::ArgParseOption(
+        "ss", "sequencing_summary", "path to a MinKNOW / Dorado sequencing summary. Reads are picked in the summary (spread over the run time) and only these records are fetched from the input files.",
+        seqan::ArgParseArgument::STRING, "summary file"));
+
+    addOption(parser, seqan::ArgParseOption(
+        "w", "watch", "Watch a run directory while it is sequencing: new files are added to the sample as they are written, and outputs are updated when the top k-mers change. Stops when MinKNOW writes the final summary."
+        ));
+
+    addOption(parser, seqan::ArgParseOption(
+        "wi", "watch_interval", "polling interval of the watch mode, in seconds. Default is 10",
+        seqan::ArgParseArgument::INTEGER, "INT"));
+
+    addOption(parser, seqan::ArgParseOption(
+        "sc", "sample_cache", "path to a sample cache. If it matches the input, sampled reads are loaded from it instead of parsing the input, else it is (re)written after sampling.",
+        seqan::ArgParseArgument::STRING, "cache file"));
+
     addOption(parser, seqan::ArgParseOption(
         "o", "out_file", "path to the output file, default is ./out.txt",
         seqan::ArgParseArgument::STRING, "output file"));
@@ -569,6 +4466,9 @@ int main(int argc, char const ** argv)
     std::string exact_out;   // exact count output file
     std::string config_file; // configuration file
     std::string forbid_kmer; // forbidden kmers file, one kmer per line.
+    std::string forbid_save; // binary filter of the forbidden kmers, to write
+    std::string sample_cache; // binary cache of the sampled reads
+    std::string summary_file; // sequencing summary, used to pick the reads
     uint64_t solid_km= 0;       // Use solid k-mer instead of most frequent
     uint64_t nb_thread = 4;  // default number of thread
     uint64_t k = 16;         // kmer size, 2<= k <= 32
@@ -576,8 +4476,16 @@ int main(int argc, char const ** argv)
     uint64_t sn = 10000;     // number of sequence sampled
     uint64_t limit = 500;    // number of kmers to keep.
     double lc = 1.5;         // low complexity filter threshold, allow all known adapters to pass.
+    uint64_t min_length = 0; // minimum read length
+    bool length_stratified = false; // stratify the sample on read length
+    double min_quality = 0;  // minimum mean quality of the sampled ends
+    uint64_t quality_mask = 0; // bases of lower quality are masked
     uint64_t v = 1;          // verbosity
     bool skip_end = false;   // skip end adapter ressearch
+    bool stream = false;     // stream the input into a reservoir of read ends
+    bool random_offsets = false; // sample the input at random byte offsets
+    bool watch = false;      // watch a run directory while it is sequencing
+    uint64_t watch_interval = 10; // polling interval of the watch mode, in seconds
 
 
 
@@ -594,9 +4502,20 @@ int main(int argc, char const ** argv)
         limit     = params.count("lim")>0 ? std::stoi(params["lim"]) : limit;
         nb_thread = params.count("nt" )>0 ? std::stoi(params["nt"] ) : nb_thread;
         solid_km  = params.count("sk" )>0 ? std::stoi(params["sk"] ) : solid_km;
+        min_length   = params.count("ml")>0 ? std::stoi(params["ml"]) : min_length;
+        length_stratified = params.count("ls")>0 ? true : false;
+        min_quality  = params.count("mq")>0 ? std::stof(params["mq"]) : min_quality;
+        quality_mask = params.count("qm")>0 ? std::stoi(params["qm"]) : quality_mask;
         skip_end  = params.count("se" )>0 ? true : false;
+        stream    = params.count("st" )>0 ? true : false;
+        random_offsets = params.count("ro")>0 ? true : false;
+        watch     = params.count("w"  )>0 ? true : false;
+        watch_interval = params.count("wi")>0 ? std::stoi(params["wi"]) : watch_interval;
         forbid_kmer = params.count("fk") >0 ? params["fk"] : forbid_kmer;
+        forbid_save = params.count("fs") >0 ? params["fs"] : forbid_save;
         exact_out   = params.count("e")  >0 ? params["e"]  : exact_out;    
+        sample_cache = params.count("sc") >0 ? params["sc"] : sample_cache;
+        summary_file = params.count("ss") >0 ? params["ss"] : summary_file;
     }
 
     // If options have been manually set, override config.
@@ -610,28 +4529,57 @@ int main(int argc, char const ** argv)
     getOptionValue(output, parser, "o");
     getOptionValue(exact_out, parser, "e");
     getOptionValue(forbid_kmer, parser, "fk");
+    getOptionValue(forbid_save, parser, "fs");
     getOptionValue(solid_km, parser, "sk");
+    getOptionValue(min_length, parser, "ml");
+    getOptionValue(min_quality, parser, "mq");
+    getOptionValue(quality_mask, parser, "qm");
+    getOptionValue(sample_cache, parser, "sc");
+    getOptionValue(summary_file, parser, "ss");
+    getOptionValue(watch_interval, parser, "wi");
 
     // except for flags, check if they are set in either config or manually
     skip_end = skip_end or isSet(parser, "skip_end");
+    stream = stream or isSet(parser, "stream");
+    random_offsets = random_offsets or isSet(parser, "random_offsets");
+    length_stratified = length_stratified or isSet(parser, "length_stratified");
+    watch = watch or isSet(parser, "watch");
     
     // input file, always required
     std::string input_file;
     getArgumentValue(input_file, parser, 0);
 
-    // Set of forbidden k-mers.
-    kmer_set_t kmer_set;
-    if(not forbid_kmer.empty()){
-        print("Parsing the fobidden kmer list");
-        kmer_set = parse_kmer_list(forbid_kmer);
-    }
-
     std::string warning = "/!\\ WARNING: ";
 
     // checking value for k
     if( k<2 or k>32 ){
         throw std::invalid_argument("kmer size must be between 2 and 32 (included)");
     }
+    if( quality_mask > 93 ){
+        throw std::invalid_argument("quality mask must be between 0 and 93 (included)");
+    }
+
+    // Set of forbidden k-mers.
+    kmer_filter_t kmer_set;
+    if(not forbid_kmer.empty()){
+        if(loadKmerFilter(forbid_kmer, kmer_set)){
+            print("Loaded the forbidden kmer filter");
+        }
+        else if(isFastaFile(forbid_kmer)){
+            kmer_set = referenceFilter(forbid_kmer, k, nb_thread, v);
+        }
+        else{
+            print("Parsing the fobidden kmer list");
+            kmer_set = parse_kmer_list(forbid_kmer, nb_thread);
+        }
+        if(kmer_set.k != 0 and kmer_set.k != k){
+            std::cerr << warning << "Forbidden kmers are " << int(kmer_set.k) << " bases long, none of them will be found with k = " << int(k) << std::endl;
+        }
+        if(not forbid_save.empty() and not saveKmerFilter(forbid_save, kmer_set)){
+            std::cerr << warning << "Failed to write the forbidden kmer filter" << std::endl;
+        }
+    }
+
     
     // print parameters
     if(v>0){
@@ -644,6 +4592,18 @@ int main(int argc, char const ** argv)
         if(solid_km != 0){
             std::cout << "Solid kmers:           " << solid_km << std::endl;
         }
+        if(min_length > 0){
+            std::cout << "Min read length:       " << min_length << std::endl;
+        }
+        if(length_stratified){
+            std::cout << "Length stratified:     yes" << std::endl;
+        }
+        if(min_quality > 0){
+            std::cout << "Min mean quality:      " << min_quality << std::endl;
+        }
+        if(quality_mask > 0){
+            std::cout << "Quality mask:          " << quality_mask << std::endl;
+        }
         std::cout << "Verbosity level:       " << v         << std::endl;
     }
 
@@ -656,16 +4616,129 @@ int main(int argc, char const ** argv)
 
 
 
-    // Parsing input fasta file.
-    StringSet<CharString> ids;
-    StringSet<DnaString> seqs;
-    if(v>0)
-        print("Parsing FASTA file",tab_level);
-    SeqFileIn seqFileIn(toCString(input_file));
-    readRecords(ids, seqs, seqFileIn);
+    // Parsing input fasta file. Both ends of the same reads are sampled at once.
+    end_reservoir_t reservoir;
+    initReservoir(reservoir, sn, sl);
+    setQualityFilter(reservoir, min_quality, quality_mask);
+    setLengthFilter(reservoir, min_length, length_stratified);
+    bool quality_filter = usesQualities(reservoir);
+    uint64_t sequence_set_size;
+    if(watch){
+        struct stat st;
+        if(stat(input_file.c_str(), &st) != 0 or not S_ISDIR(st.st_mode)){
+            std::cerr << "Error: --watch needs a run directory, " << input_file << " is not one" << std::endl;
+            return(1);
+        }
+        // strata are only gathered at the end of the input
+        if(length_stratified){
+            std::cerr << warning << "Length stratification ignored in watch mode" << std::endl;
+            setLengthFilter(reservoir, min_length, false);
+        }
+        if(v>0)
+            print("Watching run directory " + input_file,tab_level);
+        enableCounting(reservoir, k, lc, kmer_set);
+        return(watchRun(input_file, reservoir, nb_thread, watch_interval, limit, solid_km, k, skip_end, output, exact_out, v));
+    }
+    // the input can also be a run directory, or a glob pattern
+    std::vector<std::string> input_files = listInputFiles(input_file);
+    if(input_files.empty()){
+        std::cerr << "Error: No input file found for " << input_file << std::endl;
+        return(1);
+    }
+    bool many_files = input_files.size() > 1 or input_files[0] != input_file;
+    // an index allows to fetch the sampled reads only, it does not give their qualities
+    std::string index_file = many_files or quality_filter or length_stratified ? "" : findIndex(input_file);
+    if(not summary_file.empty() and length_stratified){
+        std::cerr << warning << "Length stratification ignored, reads are picked from the sequencing summary" << std::endl;
+    }
+    // offsets favour long reads, stratification would be meaningless
+    if(random_offsets and length_stratified){
+        std::cerr << warning << "Random offsets ignored, the sample is stratified on read length" << std::endl;
+        random_offsets = false;
+    }
+    // BAM files, pipes and the standard input can only be streamed
+    bool regular_input = many_files or isRegularFile(input_file);
+    // SeqAn can not read these (or drops the qualities), they are always streamed;
+    // gzip inputs too, so they are inflated in parallel instead of by SeqFileIn
+    stream = stream or hasExtension(input_file, ".bam") or hasExtension(input_file, ".zst") or hasExtension(input_file, ".gz")
+          or not regular_input or quality_filter or length_stratified;
+    if(not regular_input and not sample_cache.empty()){
+        std::cerr << warning << "Sample cache ignored, the input can not be fingerprinted" << std::endl;
+        sample_cache.clear();
+    }
+    // settings changing which reads end up in the sample
+    std::string sampling_settings = "index=" + index_file + ";offsets=" + std::to_string(random_offsets)
+                                  + ";min_quality=" + std::to_string(min_quality) + ";quality_mask=" + std::to_string(quality_mask)
+                                  + ";min_length=" + std::to_string(min_length) + ";stratified=" + std::to_string(length_stratified)
+                                  + ";summary=" + summary_file + ";" + std::to_string(summary_file.empty() ? 0 : fileFingerprint(summary_file));
+    uint64_t fingerprint = 0;
+    bool cached = false;
+    if(not sample_cache.empty()){
+        fingerprint = inputFingerprint(input_files, sampling_settings);
+        cached = loadSampleCache(sample_cache, reservoir, fingerprint);
+    }
+    if(cached){
+        if(v>0)
+            print("Loaded " + std::to_string(length(reservoir.starts)) + " sampled sequences from cache " + sample_cache,tab_level);
+        sequence_set_size = reservoir.seen;
+    }
+    else if(not summary_file.empty()){
+        if(v>0)
+            print("Sampling FASTA files through sequencing summary " + summary_file,tab_level);
+        summarySample(summary_file, input_files, reservoir, nb_thread, v);
+        sequence_set_size = reservoir.seen;
+    }
+    else if(many_files){
+        if(v>0)
+            print("Streaming " + std::to_string(input_files.size()) + " FASTA files",tab_level);
+        directorySample(input_files, reservoir, nb_thread, v);
+        sequence_set_size = reservoir.seen;
+    }
+    else if(not index_file.empty()){
+        if(v>0)
+            print("Sampling FASTA file through index " + index_file,tab_level);
+        if(not indexedSample(input_file, index_file, reservoir, nb_thread, v)){
+            std::cerr << warning << "Index " << index_file << " does not match the input, streaming it instead" << std::endl;
+            enableCounting(reservoir, k, lc, kmer_set);
+            streamSample(input_file, reservoir, nb_thread, v);
+        }
+        sequence_set_size = reservoir.seen;
+    }
+    else if(random_offsets){
+        if(v>0)
+            print("Sampling reads at random offsets",tab_level);
+        offsetSample(input_file, reservoir, nb_thread, v);
+        sequence_set_size = reservoir.seen;
+    }
+    else if(stream){
+        if(v>0)
+            print("Streaming FASTA file",tab_level);
+        // k-mers are counted while the input is read
+        enableCounting(reservoir, k, lc, kmer_set);
+        streamSample(input_file, reservoir, nb_thread, v);
+        sequence_set_size = reservoir.seen;
+    }
+    else{
+        if(v>0)
+            print("Parsing FASTA file",tab_level);
+        StringSet<CharString> ids;
+        read_set_type seqs;
+        SeqFileIn seqFileIn(toCString(input_file));
+        readRecords(ids, seqs, seqFileIn);
+        if(v>0)
+            print("Sampling",tab_level);
+        sampleSequences(seqs, reservoir, v);
+        sequence_set_size = reservoir.seen;
+    }
+    if(not sample_cache.empty() and not cached){
+        if(v>0)
+            print("Saving sampled sequences to cache " + sample_cache,tab_level);
+        if(not saveSampleCache(sample_cache, reservoir, fingerprint)){
+            std::cerr << warning << "Failed to write sample cache" << std::endl;
+        }
+    }
     
     // Checking if we can sample the requested number of sequences, else return the whole set
-    uint64_t sequence_set_size = length(seqs);
     if(sn > sequence_set_size){ 
         std::cerr << warning << "Sequence set too small for the requested sample size\n";
         std::cerr << warning << "The whole set will be used.\n" ;
@@ -683,36 +4756,50 @@ int main(int argc, char const ** argv)
     for(std::string which_end: ends){
 
         tab_level += 1;
-        if(v>0){
+        if(v>0)
             print("Working on " + which_end + " adapter",tab_level - 1);
-            // sample and cut sequences to required length
-            print("Sampling",tab_level);
-        }
-        sequence_set_type sample = sampleSequences(seqs, sn, sl, bottom, v);
+        // sampled and cut sequences, for this end
+        packed_sample_t & sample = bottom ? reservoir.ends : reservoir.starts;
 
 
         // counting k-mers on the sampled sequences
         if(v>0)
             print("Exact k-mer count",tab_level);
-        counter count = count_kmers(sample, k, lc, kmer_set);
+        counter count;
+        dense_counter dense_count; // small k, see dense_count_kmers
+        bool dense = not reservoir.counting and k <= DENSE_MAX_K;
+        uint64_t nb_found;
+        if(reservoir.counting){
+            count = std::move(bottom ? reservoir.end_count : reservoir.start_count);
+            nb_found = count.size();
+        }
+        else if(dense){
+            dense_count = dense_count_kmers(sample, k, lc, kmer_set, nb_thread);
+            nb_found = dense_count.size() - std::count(dense_count.begin(), dense_count.end(), 0);
+        }
+        else{
+            count = count_kmers(sample, k, lc, kmer_set, nb_thread);
+            nb_found = count.size();
+        }
         
 
         // keeping most frequents kmers
         if(v>0)
-            print("Number of kmer found: " + std::to_string(count.size()), tab_level);
+            print("Number of kmer found: " + std::to_string(nb_found), tab_level);
         
         // Either keep the most frequent kmers or keep solid kmers.
         pair_vector first_n_vector;
         if(solid_km != 0){
             if(v>0)
                 print("Keeping solid k-mer",tab_level);
-            first_n_vector = get_solid_kmers(count, solid_km);
+            first_n_vector = dense ? get_solid_kmers(dense_count, solid_km) : get_solid_kmers(count, solid_km);
         }
         else{
             if(v>0)
                 print("Keeping most frequent k-mer",tab_level);
-            first_n_vector = get_most_frequent(count, limit);
+            first_n_vector = dense ? get_most_frequent(dense_count, limit) : get_most_frequent(count, limit);
         }
+        dense_counter().swap(dense_count);
         
         if(v>0)
             print("Number of kmer kept:  " + std::to_string(first_n_vector.size()), tab_level ) ;
@@ -744,16 +4831,18 @@ int main(int argc, char const ** argv)
             }
 
         // Print a warning in stderr if we think adapter may have been trimmed.
-        if(sorted_error_count[0].second < FREQ_THRESHOLD_WARNING * sn){
+        // no kmer left at all when the whole sample is forbidden
+        uint64_t top_count = sorted_error_count.empty() ? 0 : sorted_error_count[0].second;
+        if(top_count < FREQ_THRESHOLD_WARNING * sn){
             std::cerr << warning << "The most frequent kmer has been found in less than 10% of the reads " << which_end <<"s after approximate count. ";
-            std::cerr << "(" << sorted_error_count[0].second << "/" << sn << " sequences)" <<std::endl;
+            std::cerr << "(" << top_count << "/" << sn << " sequences)" <<std::endl;
             std::cerr << warning << "It could mean this file is already trimmed or the sample do not contains detectable adapters." << std::endl;
         }
 
         if(v>0)
             print("Done",tab_level);
         
-        clear(sample);
+        sample = packed_sample_t();
         
         // Shall we process read end ?
         if(skip_end){